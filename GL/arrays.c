@@ -188,6 +188,7 @@ extern inline void gli_arrays_end(void);
 
 void gli_vertex_set(GLint idx)
 {
+	if (gli_indices) gli_cmd_vertex_id(read_index(idx));
 	return array_set(&gli_vertex_array, idx, glVertex4xv, 4);
 }
 
@@ -296,6 +297,7 @@ void glDrawElements(GLenum mode, GLsizei count, GLenum type, GLvoid const *indic
 	gli_indices = indices;
 	gli_indices_type = type;
 	if (mode >= GL_TRIANGLE_STRIP) {
+		gli_cmd_vcache_flush();	// vertex identifiers are the indices, which are only meaningfull within this call
 		gli_facet_array(mode, 0, count);
 	} else {	// lines and points
 		// TODO
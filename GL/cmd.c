@@ -48,6 +48,7 @@ static unsigned count;	// count vertexes between begin and end
 static unsigned prim;	// count primitives between begin and end
 static bool (*is_colorer_func)(void);	// tells wether te count vertex is the colorer of the prim primitive (flatshading)
 static GLfixed colorer_alpha;
+static uint32_t vertex_id;	// same_as of the next vertex, when it comes from an indexed array
 
 static struct iovec const iov_poly[] = {
 	{ .iov_base = &cmdFacet, .iov_len = sizeof(cmdFacet) },
@@ -162,28 +163,22 @@ static void point_complete(void)
 	assert(gpuOK == err); (void)err;
 }
 
-static void set_current_texture(struct gli_mipmap_data *mm)
+static struct gli_mipmap_data *set_current_texture(struct gli_texture_object *to, unsigned level)
 {
-	gpuErr err;
 	// if its not resident, load it.
-	if (! mm->is_resident) {
-		mm->img_res = gpuAlloc(mm->width_log, 1U<<mm->height_log, false);
-		if (! mm->img_res) return gli_set_error(GL_OUT_OF_MEMORY);
-		err = gpuLoadImg(gpuBuf_get_loc(mm->img_res), mm->img_nores);
-		assert(gpuOK == err); (void)err;
-		free(mm->img_nores);
-		mm->img_nores = NULL;
-		mm->is_resident = true;
-	}
+	struct gli_mipmap_data *const mm = gli_texture_use(to, level);
+	if (! mm) return NULL;
 	// then, compare with actual tex buffer. if not the same, send SetBuf cmd.
-	static uint32_t last_address = 0, last_width;
+	static uint32_t last_address = 0, last_width, last_height;
 	struct buffer_loc const *loc = gpuBuf_get_loc(mm->img_res);
-	if (loc->address != last_address || loc->width_log != last_width) {
-		err = gpuSetBuf(gpuTxtBuffer, mm->img_res, true);
+	if (loc->address != last_address || loc->width_log != last_width || loc->height != last_height) {	// evicted textures leave their place to others
+		gpuErr const err = gpuSetBuf(gpuTxtBuffer, mm->img_res, true);
 		assert(gpuOK == err); (void)err;
 		last_address = loc->address;
 		last_width = loc->width_log;
+		last_height = loc->height;
 	}
+	return mm;
 }
 
 static gpuZMode get_depth_mode(void)
@@ -246,14 +241,15 @@ static void set_mode_and_color(uint32_t *color, unsigned nb_vec, unsigned colore
 //				nb_texels >>= 1;
 //			}
 		}
-		set_current_texture(to->mipmaps + level);
+		struct gli_mipmap_data const *mm = set_current_texture(to, level);
+		if (! mm) mm = to->mipmaps + level;
 		cmdMode.mode.named.rendering_type = rendering_text;
-		if (to->mipmaps[level].need_key) {
+		if (mm->need_key) {
 			cmdMode.mode.named.use_key = 1;
 			*color = gpuColorAlpha(KEY_RED, KEY_GREEN, KEY_BLUE, KEY_ALPHA);
 		}
-		if (to->mipmaps[level].have_mean_alpha) {
-			alpha = Fix_mul(alpha, to->mipmaps[level].mean_alpha);
+		if (mm->have_mean_alpha) {
+			alpha = Fix_mul(alpha, mm->mean_alpha);
 		}
 #		define ALMOST_0 (0x2000<<7)
 		if (! gli_smooth()) {	// copy colorer intens
@@ -390,6 +386,23 @@ void gli_cmd_submit(void)
 	if (vec_idx > 2) facet_complete(vec_idx, false, 0);
 }
 
+// The next vertex comes from this index of a vertex array. The GPU will project it only once per gli_cmd_vcache_flush().
+void gli_cmd_vertex_id(unsigned id)
+{
+	vertex_id = GPU_SAME_AS_ID | id;
+}
+
+void gli_cmd_vcache_flush(void)
+{
+	static gpuCmdVCache const vcache = {
+		.opcode = gpuVCACHE,
+		.size_log = GPU_DEFAULT_VCACHE_LOG,
+		.lru = 1,
+	};
+	gpuErr const err = gpuWrite(&vcache, sizeof(vcache), true);
+	assert(gpuOK == err); (void)err;
+}
+
 void gli_cmd_vertex(int32_t const *v)
 {
 	// TODO : precalc P*M
@@ -399,7 +412,8 @@ void gli_cmd_vertex(int32_t const *v)
 	cmdVec[vec_idx].u.geom.c3d[0] = ((int64_t)clip_coords[0] * gli_viewport_width/2) >> 8;	// FIXME: set dproj = 1
 	cmdVec[vec_idx].u.geom.c3d[1] = -((int64_t)clip_coords[1] * gli_viewport_height/2) >> 8;	// gpu940 uses Y toward bottom
 	cmdVec[vec_idx].u.geom.param[0] = clip_coords[3];	// we use W as Z for gpu940 (which then must use Z toward depths)
-	cmdVec[vec_idx].same_as = 0;
+	cmdVec[vec_idx].same_as = vertex_id;
+	vertex_id = 0;
 	// Now compute vertex colors
 	bool is_colorer = is_colorer_func();
 	GLfixed const *c = NULL;
@@ -567,7 +581,7 @@ void gli_clear(gpuBufferType type, GLclampx *val)
 	rect.type = type;
 	if (type == gpuZBuffer) {
 		if (! gli_with_depth_buffer) return;
-		rect.value = *val;
+		rect.value = *val;	// the GPU maps it to the depth format of the z buffer
 	} else {	// color
 		rect.value = gpuColor((val[0]>>8)&0xFF, (val[1]>>8)&0xFF, (val[2]>>8)&0xFF);
 	}
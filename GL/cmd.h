@@ -23,6 +23,8 @@ static inline void gli_cmd_end(void) {}
 void gli_cmd_prepare(enum gli_DrawMode mode_);
 void gli_cmd_submit(void);
 void gli_cmd_vertex(int32_t const *v);
+void gli_cmd_vertex_id(unsigned id);
+void gli_cmd_vcache_flush(void);
 void gli_facet_array(enum gli_DrawMode mode, GLint first, unsigned count);
 void gli_points_array(GLint first, unsigned count);
 void gli_clear(gpuBufferType type, GLclampx *val);
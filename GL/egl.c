@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include "gli.h"
+#include <assert.h>
 
 /*
  * Data Definitions
@@ -26,6 +27,7 @@ static struct {
 	struct gpuBuf *depth;
 } buffers[3];
 static unsigned active_buffer;
+static unsigned z_shift;	// depth mapping of the 16 bits z buffers
 bool gli_with_depth_buffer;
 
 /*
@@ -61,15 +63,18 @@ GLboolean glOpen(unsigned attribs)
 	if (gpuOK != gpuOpen()) {
 		return GL_FALSE;
 	}
+	gpuBufferFormat const out_format = attribs & PACKED_COLOR_BUFFER ? gpuFmt16:gpuFmt32;
+	gpuBufferFormat const depth_format = attribs & PACKED_DEPTH_BUFFER ? gpuFmt16:gpuFmt32;
 	for (unsigned i=0; i<sizeof_array(buffers); i++) {
-		buffers[i].out = gpuAlloc(9, 250, true);
+		buffers[i].out = gpuAllocFmt(out_format, 9, 250, true);
 		if (gli_with_depth_buffer) {
-			buffers[i].depth = gpuAlloc(9, 250, true);
+			buffers[i].depth = gpuAllocFmt(depth_format, 9, 250, true);
 		} else {
 			buffers[i].depth = NULL;
 		}
 	}
 	active_buffer = ~0U;
+	z_shift = GPU_DEFAULT_ZSHIFT;
 #	ifndef NDEBUG
 	static gpuCmdDbg dbgCmd = { gpuDBG, 1 };
 	gpuWrite(&dbgCmd, sizeof(dbgCmd), true);
@@ -105,6 +110,7 @@ GLboolean glSwapBuffers(void)
 		if (gpuOK != gpuShowBuf(buffers[active_buffer].out, true)) {
 			return GL_FALSE;
 		}
+		gli_texture_swap();
 		// wait until this buffer is actually on display
 		gpuWaitDisplay();
 		if (++ active_buffer >= sizeof_array(buffers)) {
@@ -114,9 +120,18 @@ GLboolean glSwapBuffers(void)
 	if (gpuOK != gpuSetBuf(gpuOutBuffer, buffers[active_buffer].out, true)) {
 		return GL_FALSE;
 	}
-	if (buffers[active_buffer].depth && gpuOK != gpuSetBuf(gpuZBuffer, buffers[active_buffer].depth, true)) {
+	if (buffers[active_buffer].depth && gpuOK != gpuSetZBuf(buffers[active_buffer].depth, z_shift, true)) {
 		return GL_FALSE;
 	}
 	return GL_TRUE;
 }
 
+void gli_set_z_shift(unsigned new_z_shift)
+{
+	if (new_z_shift == z_shift) return;
+	z_shift = new_z_shift;
+	if (active_buffer == ~0U || ! buffers[active_buffer].depth) return;
+	gpuErr const err = gpuSetZBuf(buffers[active_buffer].depth, z_shift, true);
+	assert(gpuOK == err); (void)err;
+}
+
@@ -47,5 +47,6 @@
 #include "cmd.h"
 
 extern bool gli_with_depth_buffer;
+void gli_set_z_shift(unsigned z_shift);
 
 #endif
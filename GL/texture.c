@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "gli.h"
 #include "fixmath.h"
@@ -28,6 +29,10 @@ struct gli_texture_unit gli_texture_unit;
 static struct gli_texture_object default_texture;
 #define NB_MAX_TEXOBJ 1024
 static struct gli_texture_object *binds[NB_MAX_TEXOBJ];
+static unsigned frame;	// number of frames shown, as the GPU frame_count
+static unsigned upload_budget;	// in words per frame, 0 for no limit
+static unsigned resident_words;
+static struct glTextureStats last_stats, stats;	// of the last frame, and of the current one
 struct pixel_reader {
 	void (*read_func)(struct pixel_reader *);
 	union {
@@ -75,10 +80,16 @@ static int texture_object_ctor(struct gli_texture_object *to)
 	return 0;
 }
 
+static unsigned mipmap_words(struct gli_mipmap_data const *mm)
+{
+	return 1U << (mm->width_log + mm->height_log);
+}
+
 static void free_mipmap_datas(struct gli_mipmap_data *mm)
 {
 	if (! mm->has_data) return;
 	if (mm->is_resident) {
+		resident_words -= mipmap_words(mm);
 		gpuFree(mm->img_res);	// no need to keep it any longer
 		mm->img_res = NULL;
 	} else {
@@ -237,12 +248,7 @@ void glTexSubImage2D_nocheck(struct gli_texture_object *to, GLint level, GLint x
 {
 	struct gli_mipmap_data *const mm = to->mipmaps + level;
 	assert(mm->has_data);
-	uint32_t *dest;
-	if (mm->is_resident) {	// destination is GPU memory, so we must write gpuColors
-		dest = gli_get_texture_address(mm->img_res);
-	} else {	// destination is malloced rgb array
-		dest = mm->img_nores;
-	}
+	uint32_t *const dest = mm->is_resident ? gli_get_texture_address(mm->img_res) : mm->img_nores;
 	struct pixel_reader reader;
 	pixel_reader_ctor(&reader, format, type, pixels);
 	uint32_t sum_alpha = 0;	// 32 bits are enought for a 1024x1024 fully opaque texture.
@@ -256,15 +262,14 @@ void glTexSubImage2D_nocheck(struct gli_texture_object *to, GLint level, GLint x
 			pixel_read_next(&reader);
 			if (reader.color.c.a < 5) {	// bellow 5, we consider this is not blending but keying
 				mm->need_key = true;
-				dest[y+x] = mm->is_resident ? gpuColorAlpha(KEY_RED, KEY_GREEN, KEY_BLUE, KEY_ALPHA) : READER_KEY_COLOR;
+				dest[y+x] = gpuColorAlpha(KEY_RED, KEY_GREEN, KEY_BLUE, KEY_ALPHA);
 			} else {
 				sum_alpha += reader.color.c.a;
 				nb_alpha ++;
 				if (reader.color.u32 == READER_KEY_COLOR) {	// don't allow the use of our key color
 					reader.color.u32 = ALMOST_READER_KEY_COLOR;
 				}
-				dest[y+x] = mm->is_resident ?
-					gpuColorAlpha(reader.color.c.r, reader.color.c.g, reader.color.c.b, reader.color.c.a) : reader.color.u32;
+				dest[y+x] = gpuColorAlpha(reader.color.c.r, reader.color.c.g, reader.color.c.b, reader.color.c.a);
 			}
 		}
 	}
@@ -273,6 +278,72 @@ void glTexSubImage2D_nocheck(struct gli_texture_object *to, GLint level, GLint x
 	pixel_reader_dtor(&reader);
 }
 
+// Copy the mipmap back into client memory and free its GPU buffer.
+static bool evict(struct gli_mipmap_data *mm)
+{
+	assert(mm->has_data && mm->is_resident);
+	unsigned const words = mipmap_words(mm);
+	uint32_t *const img = malloc(words*sizeof(*img));
+	if (! img) return false;
+	memcpy(img, gli_get_texture_address(mm->img_res), words*sizeof(*img));
+	gpuFree(mm->img_res);
+	mm->img_res = NULL;
+	mm->img_nores = img;
+	mm->is_resident = false;
+	resident_words -= words;
+	stats.evictions ++;
+	stats.evicted_words += words;
+	return true;
+}
+
+// Returns the least recently used resident mipmap that the GPU is done with, if any.
+static struct gli_mipmap_data *lru_mipmap(void)
+{
+	struct gli_mipmap_data *lru = NULL;
+	for (unsigned b=0; b<sizeof_array(binds); b++) {
+		if (! binds[b]) continue;
+		for (unsigned l=0; l<sizeof_array(binds[b]->mipmaps); l++) {
+			struct gli_mipmap_data *const mm = binds[b]->mipmaps + l;
+			if (! mm->has_data || ! mm->is_resident) continue;
+			if (mm->last_used >= shared->frame_count) continue;	// commands of a frame that's not displayed yet may read it
+			if (! lru || mm->last_used < lru->last_used) lru = mm;
+		}
+	}
+	return lru;
+}
+
+static bool upload(struct gli_mipmap_data *mm)
+{
+	assert(mm->has_data && ! mm->is_resident);
+	struct gpuBuf *buf;
+	while (! (buf = gpuAlloc(mm->width_log, 1U<<mm->height_log, false))) {
+		struct gli_mipmap_data *const lru = lru_mipmap();
+		if (! lru || ! evict(lru)) return false;
+	}
+	unsigned const words = mipmap_words(mm);
+	memcpy(gli_get_texture_address(buf), mm->img_nores, words*sizeof(*mm->img_nores));
+	free(mm->img_nores);
+	mm->img_nores = NULL;
+	mm->img_res = buf;
+	mm->is_resident = true;
+	resident_words += words;
+	stats.uploads ++;
+	stats.upload_words += words;
+	return true;
+}
+
+// Another level of this texture that's resident, coarser ones first.
+static struct gli_mipmap_data *resident_level(struct gli_texture_object *to, unsigned level)
+{
+	for (unsigned l=level+1; l<sizeof_array(to->mipmaps); l++) {
+		if (to->mipmaps[l].has_data && to->mipmaps[l].is_resident) return to->mipmaps+l;
+	}
+	for (unsigned l=level; l--; ) {
+		if (to->mipmaps[l].has_data && to->mipmaps[l].is_resident) return to->mipmaps+l;
+	}
+	return NULL;
+}
+
 /*
  * Public Functions
  */
@@ -283,6 +354,10 @@ int gli_texture_begin(void)
 	if (0 != texture_unit_ctor(&gli_texture_unit)) return -1;
 	binds[0] = &default_texture;
 	for (unsigned b=1; b<sizeof_array(binds); b++) binds[b] = NULL;
+	frame = 0;
+	resident_words = 0;
+	memset(&stats, 0, sizeof(stats));
+	memset(&last_stats, 0, sizeof(last_stats));
 	return 0;
 }
 
@@ -303,6 +378,46 @@ struct gli_texture_object *gli_get_texture_object(void)
 	return binds[gli_texture_unit.bound];
 }
 
+// Returns the mipmap to draw with (made resident), which is another level if this one is over the upload budget.
+struct gli_mipmap_data *gli_texture_use(struct gli_texture_object *to, unsigned level)
+{
+	struct gli_mipmap_data *mm = to->mipmaps + level;
+	if (! mm->has_data) return NULL;
+	if (! mm->is_resident) {
+		struct gli_mipmap_data *const other =
+			upload_budget && stats.upload_words + mipmap_words(mm) > upload_budget ?
+			resident_level(to, level) : NULL;
+		if (other) {
+			mm = other;
+			stats.fallbacks ++;
+		} else if (! upload(mm)) {
+			gli_set_error(GL_OUT_OF_MEMORY);
+			return NULL;
+		}
+	}
+	mm->last_used = frame;
+	return mm;
+}
+
+// Called when a frame was shown.
+void gli_texture_swap(void)
+{
+	frame ++;
+	last_stats = stats;
+	memset(&stats, 0, sizeof(stats));
+}
+
+void glTextureBudget(unsigned max_words)
+{
+	upload_budget = max_words;
+}
+
+void glGetTextureStats(struct glTextureStats *stats_)
+{
+	*stats_ = last_stats;
+	stats_->resident_words = resident_words;
+}
+
 void glTexParameterx(GLenum target, GLenum pname, GLfixed param)
 {
 	if (target != GL_TEXTURE_2D || /*pname < GL_TEXTURE_MIN_FILTER ||*/ pname > GL_TEXTURE_WRAP_T) {
@@ -418,8 +533,7 @@ void glTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei widt
 		glTexSubImage2D_nocheck(to, level, 0, 0, width, height, format, type, pixels);
 	}
 	// Notice that the texture will no be made resident untill we actually use it for drawing.
-	// It will then remain resident until deleted or no more GPU memory.
-	// Unloading unused textures would be a great feature to add later.
+	// It will then remain resident until deleted, or evicted by gli_texture_use() when GPU memory is lacking.
 }
 
 void glTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixels)
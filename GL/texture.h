@@ -23,10 +23,11 @@ struct gli_texture_object {
 		unsigned height_log, width_log;	// size of this level picture
 		bool is_resident;	// meaningfull only if has_data
 		bool has_data;
-		uint32_t *img_nores;	// if has_data and !is_resident
+		uint32_t *img_nores;	// if has_data and !is_resident. Holds gpuColors, ready to be copied into img_res.
 		struct gpuBuf *img_res;	// if has_data and is_resident
 		GLfixed mean_alpha;
 		bool need_key, have_mean_alpha;
+		unsigned last_used;	// number of frames shown when it was last drawn with, if is_resident
 	} mipmaps[GLI_MAX_TEXTURE_SIZE_LOG+1];
 	// These parameters are the same for all mipmaps, although this is unclear if they are required to be
 	enum gli_TexFilter min_filter, max_filter;
@@ -42,5 +43,7 @@ struct gli_texture_object {
 int gli_texture_begin(void);
 void gli_texture_end(void);
 struct gli_texture_object *gli_get_texture_object(void);
+struct gli_mipmap_data *gli_texture_use(struct gli_texture_object *to, unsigned level);
+void gli_texture_swap(void);
 
 #endif
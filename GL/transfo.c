@@ -104,6 +104,14 @@ static void scale_vec(int32_t vec[4], int32_t s)
 	}
 }
 
+// We use W as Z for gpu940, so the farthest depth is the distance to the far plane
+static void set_depth_range(GLfixed far)
+{
+	unsigned z_shift = 0;
+	while ((far >> z_shift) > 0xffff) z_shift ++;
+	gli_set_z_shift(z_shift);
+}
+
 static void frustum_ortho(int frustrum, GLfixed left, GLfixed right, GLfixed bottom, GLfixed top, GLfixed near, GLfixed far)
 {
 	GLfixed mat[16];
@@ -127,6 +135,7 @@ static void frustum_ortho(int frustrum, GLfixed left, GLfixed right, GLfixed bot
 		mat[13] = 0;
 		mat[14] = -Fix_mul( Fix_mul(far, near), fni<<1);
 		mat[15] = 0;
+		set_depth_range(far);
 	} else {	// ortho
 		mat[0] = rli << 1;
 		mat[5] = tbi << 1;
@@ -0,0 +1,331 @@
+/* This file is part of gpu940.
+ *
+ * Copyright (C) 2006 Cedric Cellier.
+ *
+ * Gpu940 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * Gpu940 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gpu940; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* A small ARMv4 interpreter, so that the code generated by codegen.c can be run and checked
+ * on the PC. It covers what codegen emits (data processing, multiplies, word and halfword
+ * transfers, block transfers and branches), in user mode and without coprocessors.
+ */
+#include "gpu940i.h"
+#include "armemu.h"
+
+#ifndef GP2X
+
+/*
+ * Data Definitions
+ */
+
+#define RETURN_ADDR 0xfffffffcU	// we stop when the code jumps there
+#define STACK_SIZE 64	// in words
+
+static uint32_t reg[16];	// r15 reads as the instruction address + 8
+static bool pc_written;	// the instruction jumped somewhere
+static bool flag_n, flag_z, flag_c, flag_v;
+static uint32_t stack[STACK_SIZE];
+static struct arm_region const *regions;
+static unsigned nb_regions;
+
+/*
+ * Private Functions
+ */
+
+static void set_reg(unsigned r, uint32_t value)
+{
+	reg[r] = value;
+	if (r == 15) pc_written = true;
+}
+
+static uint32_t low32(void const *ptr)
+{
+	return (uint32_t)(uintptr_t)ptr;
+}
+
+static void *host_addr(uint32_t addr, unsigned size)
+{
+	for (unsigned r=0; r<nb_regions; r++) {
+		uint32_t const offset = addr - low32(regions[r].base);
+		if (offset < regions[r].size && regions[r].size - offset >= size) {
+			return (uint8_t *)regions[r].base + offset;
+		}
+	}
+	if (addr - low32(stack) < sizeof(stack)) return (uint8_t *)stack + (addr - low32(stack));
+	assert(! "access out of the known regions");
+	return NULL;
+}
+
+static uint32_t load(uint32_t addr, unsigned size)
+{
+	assert(0 == (addr & (size-1)));
+	void const *const p = host_addr(addr, size);
+	if (size == 4) return *(uint32_t const *)p;
+	if (size == 2) return *(uint16_t const *)p;
+	return *(uint8_t const *)p;
+}
+
+static void store(uint32_t addr, unsigned size, uint32_t value)
+{
+	assert(0 == (addr & (size-1)));
+	void *const p = host_addr(addr, size);
+	if (size == 4) *(uint32_t *)p = value;
+	else if (size == 2) *(uint16_t *)p = value;
+	else *(uint8_t *)p = value;
+}
+
+static bool cond_passed(uint32_t insn)
+{
+	switch (insn >> 28) {
+		case 0x0: return flag_z;
+		case 0x1: return !flag_z;
+		case 0x2: return flag_c;
+		case 0x3: return !flag_c;
+		case 0x4: return flag_n;
+		case 0x5: return !flag_n;
+		case 0x6: return flag_v;
+		case 0x7: return !flag_v;
+		case 0x8: return flag_c && !flag_z;
+		case 0x9: return !flag_c || flag_z;
+		case 0xa: return flag_n == flag_v;
+		case 0xb: return flag_n != flag_v;
+		case 0xc: return !flag_z && flag_n == flag_v;
+		case 0xd: return flag_z || flag_n != flag_v;
+		case 0xe: return true;
+	}
+	assert(! "unsupported condition");
+	return false;
+}
+
+// amount is the raw amount when by_reg, and the 5 bits immediate otherwise (0 meaning 32 or RRX)
+static uint32_t shift(uint32_t value, unsigned type, unsigned amount, bool by_reg, bool *carry)
+{
+	if (by_reg && amount == 0) return value;
+	switch (type) {
+		case 0:	// LSL
+			if (amount == 0) return value;
+			if (amount > 32) { *carry = false; return 0; }
+			*carry = (value >> (32-amount)) & 1;
+			return amount == 32 ? 0 : value << amount;
+		case 1:	// LSR
+			if (amount == 0) amount = 32;
+			if (amount > 32) { *carry = false; return 0; }
+			*carry = (value >> (amount-1)) & 1;
+			return amount == 32 ? 0 : value >> amount;
+		case 2:	// ASR
+			if (amount == 0 || amount > 32) amount = 32;
+			*carry = (value >> (amount-1)) & 1;
+			return amount == 32 ? (uint32_t)((int32_t)value >> 31) : (uint32_t)((int32_t)value >> amount);
+		default:	// ROR
+			if (amount == 0) {	// RRX
+				bool const c = value & 1;
+				value = (value >> 1) | ((uint32_t)*carry << 31);
+				*carry = c;
+				return value;
+			}
+			amount &= 31;
+			if (amount == 0) { *carry = value >> 31; return value; }
+			*carry = (value >> (amount-1)) & 1;
+			return (value >> amount) | (value << (32-amount));
+	}
+}
+
+static uint32_t operand2(uint32_t insn, bool *carry)
+{
+	*carry = flag_c;
+	if (insn & (1U<<25)) {	// rotated immediate
+		unsigned const rot = ((insn >> 8) & 0xf) * 2;
+		uint32_t const imm = insn & 0xff;
+		if (rot == 0) return imm;
+		uint32_t const value = (imm >> rot) | (imm << (32-rot));
+		*carry = value >> 31;
+		return value;
+	}
+	uint32_t const rm = reg[insn & 0xf];
+	if (insn & (1U<<4)) {	// shift by register
+		return shift(rm, (insn >> 5) & 3, reg[(insn >> 8) & 0xf] & 0xff, true, carry);
+	}
+	return shift(rm, (insn >> 5) & 3, (insn >> 7) & 0x1f, false, carry);
+}
+
+static void set_nz(uint32_t value)
+{
+	flag_n = value >> 31;
+	flag_z = value == 0;
+}
+
+static uint32_t add_with_carry(uint32_t a, uint32_t b, bool carry_in, bool set_flags)
+{
+	uint64_t const sum = (uint64_t)a + b + carry_in;
+	uint32_t const res = sum;
+	if (set_flags) {
+		set_nz(res);
+		flag_c = sum >> 32;
+		flag_v = ((a ^ res) & (b ^ res)) >> 31;
+	}
+	return res;
+}
+
+static void data_processing(uint32_t insn)
+{
+	bool carry;
+	uint32_t const op2 = operand2(insn, &carry);
+	uint32_t const rn = reg[(insn >> 16) & 0xf];
+	unsigned const rd = (insn >> 12) & 0xf;
+	bool const s = insn & (1U<<20);
+	uint32_t res = 0;
+	bool write = true, logical = true;
+	switch ((insn >> 21) & 0xf) {
+		case 0x0: res = rn & op2; break;	// AND
+		case 0x1: res = rn ^ op2; break;	// EOR
+		case 0x2: res = add_with_carry(rn, ~op2, true, s); logical = false; break;	// SUB
+		case 0x3: res = add_with_carry(op2, ~rn, true, s); logical = false; break;	// RSB
+		case 0x4: res = add_with_carry(rn, op2, false, s); logical = false; break;	// ADD
+		case 0x5: res = add_with_carry(rn, op2, flag_c, s); logical = false; break;	// ADC
+		case 0x6: res = add_with_carry(rn, ~op2, flag_c, s); logical = false; break;	// SBC
+		case 0x7: res = add_with_carry(op2, ~rn, flag_c, s); logical = false; break;	// RSC
+		case 0x8: res = rn & op2; write = false; break;	// TST
+		case 0x9: res = rn ^ op2; write = false; break;	// TEQ
+		case 0xa: res = add_with_carry(rn, ~op2, true, true); logical = false; write = false; break;	// CMP
+		case 0xb: res = add_with_carry(rn, op2, false, true); logical = false; write = false; break;	// CMN
+		case 0xc: res = rn | op2; break;	// ORR
+		case 0xd: res = op2; break;	// MOV
+		case 0xe: res = rn & ~op2; break;	// BIC
+		case 0xf: res = ~op2; break;	// MVN
+	}
+	if (s && logical) {
+		set_nz(res);
+		flag_c = carry;
+	}
+	if (write) {
+		assert(! (s && rd == 15));	// no SPSR here
+		set_reg(rd, res);
+	}
+}
+
+static void multiply(uint32_t insn)
+{
+	unsigned const rd_hi = (insn >> 16) & 0xf, rd_lo = (insn >> 12) & 0xf;
+	uint32_t const rs = reg[(insn >> 8) & 0xf], rm = reg[insn & 0xf];
+	bool const s = insn & (1U<<20), acc = insn & (1U<<21);
+	if (insn & (1U<<23)) {	// long multiplies
+		uint64_t res;
+		if (insn & (1U<<22)) res = (int64_t)(int32_t)rm * (int32_t)rs;
+		else res = (uint64_t)rm * rs;
+		if (acc) res += ((uint64_t)reg[rd_hi] << 32) | reg[rd_lo];
+		set_reg(rd_lo, res);
+		set_reg(rd_hi, res >> 32);
+		if (s) {
+			flag_n = res >> 63;
+			flag_z = res == 0;
+		}
+	} else {
+		uint32_t res = rm * rs;
+		if (acc) res += reg[(insn >> 12) & 0xf];
+		set_reg(rd_hi, res);
+		if (s) set_nz(res);
+	}
+}
+
+static void transfer(uint32_t insn, uint32_t offset, unsigned size, bool sign)
+{
+	unsigned const rn = (insn >> 16) & 0xf, rd = (insn >> 12) & 0xf;
+	bool const pre = insn & (1U<<24), up = insn & (1U<<23), writeback = insn & (1U<<21), ld = insn & (1U<<20);
+	uint32_t const base = reg[rn];
+	uint32_t const moved = up ? base + offset : base - offset;
+	uint32_t const addr = pre ? moved : base;
+	if (ld) {
+		uint32_t value = load(addr, size);
+		if (sign) value = size == 2 ? (uint32_t)(int16_t)value : (uint32_t)(int8_t)value;
+		if (writeback || !pre) set_reg(rn, moved);
+		set_reg(rd, value);	// after the writeback, as the loaded value wins
+	} else {
+		uint32_t value = reg[rd];
+		if (rd == 15) value += 4;	// stored pc is the instruction address + 12
+		store(addr, size, value);
+		if (writeback || !pre) set_reg(rn, moved);
+	}
+}
+
+static void block_transfer(uint32_t insn)
+{
+	unsigned const rn = (insn >> 16) & 0xf;
+	bool const pre = insn & (1U<<24), up = insn & (1U<<23), writeback = insn & (1U<<21), ld = insn & (1U<<20);
+	assert(! (insn & (1U<<22)));	// no user bank or SPSR here
+	unsigned nb_regs = 0;
+	for (unsigned r=0; r<16; r++) nb_regs += (insn >> r) & 1;
+	// lowest register goes to lowest address
+	uint32_t addr = up ? reg[rn] : reg[rn] - 4*nb_regs;
+	if (pre == up) addr += 4;
+	uint32_t const new_base = up ? reg[rn] + 4*nb_regs : reg[rn] - 4*nb_regs;
+	for (unsigned r=0; r<16; r++) {
+		if (! ((insn >> r) & 1)) continue;
+		if (ld) set_reg(r, load(addr, 4));
+		else store(addr, 4, r == 15 ? reg[15]+4 : reg[r]);
+		addr += 4;
+	}
+	if (writeback && !(ld && ((insn >> rn) & 1))) set_reg(rn, new_base);
+}
+
+/*
+ * Public Functions
+ */
+
+// Runs the code at entry, with lr set so that it stops when the code returns. The code can only
+// access the given regions and a small stack. Returns the number of executed instructions.
+unsigned arm_run(uint32_t const *entry, struct arm_region const *regions_, unsigned nb_regions_)
+{
+	regions = regions_;
+	nb_regions = nb_regions_;
+	for (unsigned r=0; r<sizeof_array(reg); r++) reg[r] = 0;
+	flag_n = flag_z = flag_c = flag_v = false;
+	reg[13] = low32(stack + STACK_SIZE);
+	reg[14] = RETURN_ADDR;
+	uint32_t pc = low32(entry);
+	unsigned nb_insns = 0;
+	while (pc != RETURN_ADDR) {
+		uint32_t const insn = load(pc, 4);
+		nb_insns ++;
+		reg[15] = pc + 8;
+		pc_written = false;
+		if (cond_passed(insn)) {
+			if ((insn & 0x0e000000) == 0x0a000000) {	// branch
+				if (insn & (1U<<24)) reg[14] = pc + 4;
+				int32_t const offset = (int32_t)(insn << 8) >> 6;
+				set_reg(15, pc + 8 + offset);
+			} else if ((insn & 0x0e000000) == 0x08000000) {
+				block_transfer(insn);
+			} else if ((insn & 0x0c000000) == 0x04000000) {	// word and byte transfers
+				uint32_t offset = insn & 0xfff;
+				if (insn & (1U<<25)) {
+					bool carry = flag_c;
+					assert(! (insn & (1U<<4)));
+					offset = shift(reg[insn & 0xf], (insn >> 5) & 3, (insn >> 7) & 0x1f, false, &carry);
+				}
+				transfer(insn, offset, insn & (1U<<22) ? 1:4, false);
+			} else if ((insn & 0x0f0000f0) == 0x00000090) {	// short and long multiplies
+				multiply(insn);
+			} else if ((insn & 0x0e000090) == 0x00000090 && (insn & 0x60)) {	// halfword and signed transfers
+				uint32_t const offset = insn & (1U<<22) ? ((insn >> 4) & 0xf0) | (insn & 0xf) : reg[insn & 0xf];
+				transfer(insn, offset, insn & (1U<<5) ? 2:1, insn & (1U<<6));
+			} else {
+				assert((insn & 0x0c000000) == 0);
+				data_processing(insn);
+			}
+		}
+		pc = pc_written ? reg[15] : pc + 4;
+	}
+	return nb_insns;
+}
+
+#endif
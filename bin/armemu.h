@@ -0,0 +1,30 @@
+/* This file is part of gpu940.
+ *
+ * Copyright (C) 2006 Cedric Cellier.
+ *
+ * Gpu940 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * Gpu940 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gpu940; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ARMEMU_H_261019
+#define ARMEMU_H_261019
+
+// A memory block the interpreted code may access. Addresses are the low 32 bits of host
+// addresses, so that pointers stored in these blocks are still usable by the interpreted code.
+struct arm_region {
+	void *base;
+	uint32_t size;	// in bytes
+};
+
+unsigned arm_run(uint32_t const *entry, struct arm_region const *regions, unsigned nb_regions);
+
+#endif
@@ -0,0 +1,237 @@
+/* This file is part of gpu940.
+ *
+ * Copyright (C) 2006 Cedric Cellier.
+ *
+ * Gpu940 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * Gpu940 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gpu940; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "gpu940i.h"
+
+/*
+ * Data Definitions
+ */
+
+// Clearing a buffer with gpuRECT only tags the bands of rows it fully covers. A band is actually
+// cleared when something is about to be drawn in it (see clear_touch()), when the buffer is displayed
+// on the GP2X (see clear_flush()), or when its tag is evicted. Tags are dropped when the buffer is
+// used as a texture or uploaded to (see clear_forget()).
+#define NB_CLEAR_TAGS 4
+static struct clear_tag tags[NB_CLEAR_TAGS];
+static unsigned next_evicted = 0;
+
+/*
+ * Private Functions
+ */
+
+static void memset_pixels16(uint16_t *dst, uint16_t even, uint16_t odd, unsigned width) {
+	if (width && pixel_is_odd(dst)) {
+		*dst++ = odd;
+		width --;
+	}
+	// now we are word aligned : write pixels by pairs
+	my_memset_words((uint32_t *)dst, even | ((uint32_t)odd<<16), width>>1);
+	if (width & 1) {
+		dst[width-1] = even;
+	}
+}
+
+static void fill_row(uint8_t *dst, unsigned pix_log, uint32_t const *fill, unsigned width)
+{
+	if (pix_log == 1) {
+		memset_pixels16((uint16_t *)dst, fill[0], fill[1], width);
+	} else {
+		my_memset_words((uint32_t *)dst, fill[0], width);
+	}
+}
+
+static unsigned band_log_of(uint32_t height)
+{
+	// we want at most 32 bands, so that pending bands fit in a word
+	unsigned band_log = 3;
+	while (height && ((height-1) >> band_log) >= 32) band_log ++;
+	return band_log;
+}
+
+// bits of bands [first, last)
+static uint32_t bands_mask(unsigned first, unsigned last)
+{
+	if (last > 32) last = 32;
+	if (first >= last) return 0;
+	uint32_t const upto_last = last == 32 ? ~0U : (1U<<last)-1;
+	return upto_last & ~((1U<<first)-1);
+}
+
+static unsigned pix_log_of(struct buffer_loc const *loc)
+{
+	return loc->format == gpuFmt16 ? 1:2;
+}
+
+// Returns the tag of this buffer, if any. The GPU is not told when a buffer is freed, so a tag may
+// outlive its buffer : if another buffer now lies at this address, the tag is stale and is dropped.
+static struct clear_tag *find_tag(struct buffer_loc const *loc)
+{
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		if (! tags[t].pending || tags[t].address != loc->address) continue;
+		if (
+			tags[t].width_log == loc->width_log && tags[t].height == loc->height &&
+			tags[t].pix_log == pix_log_of(loc)
+		) return tags+t;
+		tags[t].pending = 0;
+		break;
+	}
+	return NULL;
+}
+
+static void materialize_band(struct clear_tag *tag, unsigned b)
+{
+	uint8_t *dst = (uint8_t *)&shared->buffers[tag->address] + (((b << (tag->band_log + tag->width_log)) + tag->x_start) << tag->pix_log);
+	for (unsigned r = 1U<<tag->band_log; r--; ) {
+		fill_row(dst, tag->pix_log, tag->fill, tag->width);
+		dst += 1U << (tag->width_log + tag->pix_log);
+	}
+	tag->pending &= ~(1U<<b);
+}
+
+static void materialize(struct clear_tag *tag, uint32_t mask)
+{
+	mask &= tag->pending;
+	for (unsigned b=0; mask; b++, mask >>= 1) {
+		if (mask & 1) materialize_band(tag, b);
+	}
+}
+
+static struct clear_tag *new_tag(void)
+{
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		if (! tags[t].pending) return tags+t;
+	}
+	struct clear_tag *tag = tags + next_evicted;
+	if (++ next_evicted >= sizeof_array(tags)) next_evicted = 0;
+	materialize(tag, ~0U);
+	return tag;
+}
+
+static void touch_buffer(gpuBufferType type, int32_t y_start, int32_t y_stop)
+{
+	struct clear_tag *const tag = find_tag(&ctx.location.buffer_loc[type]);
+	if (! tag) return;
+	if (y_start < 0) y_start = 0;
+	if (y_stop < y_start) return;
+	materialize(tag, bands_mask(y_start >> tag->band_log, (y_stop >> tag->band_log) + 1));
+}
+
+/*
+ * Public Functions
+ */
+
+// Clears a rectangle of the current buffer of the given type. x and y are buffer coordinates.
+void clear_rect(gpuBufferType type, int32_t x, int32_t y, unsigned width, unsigned height, uint32_t value)
+{
+	struct buffer_loc const *const loc = &ctx.location.buffer_loc[type];
+	unsigned const pix_log = ctx.location.pix_log[type];
+	uint32_t fill[2] = { value, value };
+	if (pix_log == 1 && type == gpuZBuffer) {
+		fill[0] = fill[1] = z_to_depth16(value);
+	} else if (pix_log == 1) {
+		fill[0] = color_32to16(value, 0);
+		fill[1] = color_32to16(value, 1);
+	}
+	unsigned const band_log = band_log_of(loc->height);
+	uint32_t const covered = type == gpuTxtBuffer ? 0 :	// textures are read by the rasterizer : clear them now
+		bands_mask((y + (1<<band_log) - 1) >> band_log, (y + height) >> band_log);
+	struct clear_tag *tag = find_tag(loc);
+	if (tag && (
+		tag->x_start != x || tag->width != width ||
+		tag->fill[0] != fill[0] || tag->fill[1] != fill[1]
+	)) {
+		// Another rect or value : finish pending clears first, but those that are about to be overwritten
+		if (tag->x_start == x && tag->width == width) {
+			tag->pending &= ~covered;
+		}
+		materialize(tag, ~0U);
+		tag = NULL;
+	}
+	if (covered && ! tag) {
+		tag = new_tag();
+		tag->address = loc->address;
+		tag->width_log = loc->width_log;
+		tag->height = loc->height;
+		tag->pix_log = pix_log;
+		tag->band_log = band_log;
+		tag->x_start = x;
+		tag->width = width;
+		tag->fill[0] = fill[0];
+		tag->fill[1] = fill[1];
+		tag->pending = 0;
+	}
+	if (tag) tag->pending |= covered;
+	// Now clear the rows that are not in a pending band
+	uint8_t *dst = location_pos(type, x, y);
+	for (unsigned r=0; r<height; r++) {
+		if (! tag || ! (tag->pending & bands_mask((y+r) >> band_log, ((y+r) >> band_log) + 1))) {
+			fill_row(dst, pix_log, fill, width);
+		}
+		dst += 1U << (loc->width_log + pix_log);
+	}
+}
+
+// Must be called before drawing anything in rows y_start to y_stop (included) of the window.
+void clear_touch(int32_t y_start, int32_t y_stop)
+{
+	touch_buffer(gpuOutBuffer, y_start + ctx.view.winPos[1], y_stop + ctx.view.winPos[1]);
+	touch_buffer(gpuZBuffer, y_start + ctx.view.winPos[1], y_stop + ctx.view.winPos[1]);
+}
+
+// Clears all pending bands of this buffer.
+void clear_flush(struct buffer_loc const *loc)
+{
+	struct clear_tag *const tag = find_tag(loc);
+	if (tag) materialize(tag, ~0U);
+}
+
+// Drops the pending bands of this buffer (if any) without clearing them, for its whole content is
+// about to be given by the client.
+void clear_forget(struct buffer_loc const *loc)
+{
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		if (tags[t].address == loc->address) tags[t].pending = 0;
+	}
+}
+
+// Copy the clear tag of this buffer (if any) so that display() can show pending bands without clearing them.
+void clear_snapshot(struct buffer_loc const *loc, struct clear_tag *snap)
+{
+	struct clear_tag const *const tag = find_tag(loc);
+	if (tag) *snap = *tag;
+	else snap->pending = 0;
+}
+
+// The buffer at src was copied to dst : its pending bands are pending there now.
+void clear_relocate(uint32_t src, uint32_t dst)
+{
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		if (tags[t].address == dst) tags[t].pending = 0;	// stale, since dst was free
+	}
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		if (tags[t].pending && tags[t].address == src) tags[t].address = dst;
+	}
+}
+
+// Forget all pending clears.
+void clear_reset(void)
+{
+	for (unsigned t=0; t<sizeof_array(tags); t++) {
+		tags[t].pending = 0;
+	}
+	next_evicted = 0;
+}
@@ -0,0 +1,43 @@
+/* This file is part of gpu940.
+ *
+ * Copyright (C) 2006 Cedric Cellier.
+ *
+ * Gpu940 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * Gpu940 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gpu940; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef CLEAR_H_070115
+#define CLEAR_H_070115
+#include "../config.h"
+
+// A clear tag tells which bands of rows of a buffer are still to be cleared.
+struct clear_tag {
+	uint32_t address;	// of the buffer, as in buffer_loc
+	uint32_t width_log;
+	uint32_t height;
+	uint32_t pix_log;
+	uint32_t band_log;	// a band is 1<<band_log rows of the buffer
+	int32_t x_start;	// columns to clear
+	uint32_t width;
+	uint32_t fill[2];	// values of even and odd pixels
+	uint32_t pending;	// bit b is set if band b is still to be cleared. 0 means the tag is unused.
+};
+
+void clear_rect(gpuBufferType type, int32_t x, int32_t y, unsigned width, unsigned height, uint32_t value);
+void clear_touch(int32_t y_start, int32_t y_stop);
+void clear_flush(struct buffer_loc const *loc);
+void clear_forget(struct buffer_loc const *loc);
+void clear_snapshot(struct buffer_loc const *loc, struct clear_tag *snap);
+void clear_relocate(uint32_t src, uint32_t dst);
+void clear_reset(void);
+
+#endif
@@ -22,6 +22,8 @@
  * Data Definitions
  */
 
+#define GUARD_BAND 512	// pixels around the window in which polygons are scissored rather than clipped
+
 #define CACHE_SIZE 8
 static struct {
 	int32_t x,y;
@@ -32,6 +34,22 @@ static int cache_depth = 0;
 static unsigned cache_hit = 0;
 static unsigned cache_miss = 0;
 
+// Vectors which same_as holds an identifier (GPU_SAME_AS_ID) are cached in this set associative
+// cache, which entries are valid until the next gpuVCACHE or gpuSETVIEW.
+#define ID_CACHE_WAYS 4
+#define ID_CACHE_MAX_LOG 8
+static struct id_cache_entry {
+	uint32_t id;	// with GPU_SAME_AS_ID set, so that 0 means an empty entry
+	uint32_t age;	// last use (LRU) or insertion (FIFO)
+	int32_t x, y;
+	int32_t clipped;
+} id_cache[1U<<ID_CACHE_MAX_LOG];
+static unsigned id_cache_sets_log = GPU_DEFAULT_VCACHE_LOG - 2;
+static bool id_cache_lru = true;
+static uint32_t id_cache_clock = 0;
+static unsigned id_cache_hit = 0;
+static unsigned id_cache_miss = 0;
+
 /*
  * Private Functions
  */
@@ -72,14 +90,41 @@ static gpuVector *new_vec(gpuVector *prev, gpuVector *next, unsigned p)
 	return new;
 }
 
-static void compute_h(gpuVector *v, gpuPlane const *const plane)
+static int32_t plane_h(int32_t const *c3d, gpuPlane const *const plane)
 {
-	v->h = 0;
+	int32_t h = 0;
 	for (unsigned c=3; c--; ) {
 		//if (0 == plane->normal[c]) continue;
-		v->h += Fix_mul(plane->normal[c], v->cmd->u.geom.c3d[c] - plane->origin[c]);
+		h += Fix_mul(plane->normal[c], c3d[c] - plane->origin[c]);
 	}
-	if (0 == v->h) v->h = 1;
+	if (0 == h) h = 1;
+	return h;
+}
+
+static void compute_h(gpuVector *v, gpuPlane const *const plane)
+{
+	v->h = plane_h(v->cmd->u.geom.c3d, plane);
+}
+
+// Returns a mask of the clip planes v is out of (bit p for plane p).
+// Window sides are tested directly against the frustum, without the normalized plane equations.
+static uint32_t outcode(gpuVector const *v)
+{
+	if (v->proj && !v->clipped && !have_user_clipPlanes()) return 0;	// known to lie within the window
+	int32_t const *const c3d = v->cmd->u.geom.c3d;
+	int64_t const z = c3d[2];
+	int64_t const x = (int64_t)c3d[0] << ctx.view.dproj;
+	int64_t const y = (int64_t)c3d[1] << ctx.view.dproj;
+	uint32_t oc = 0;
+	if (z < ctx.view.clipPlanes[0].origin[2]) oc |= 1U<<0;
+	if (x > ctx.view.clipMax[0]*z) oc |= 1U<<1;	// right
+	if (y > ctx.view.clipMax[1]*z) oc |= 1U<<2;	// up
+	if (x < ctx.view.clipMin[0]*z) oc |= 1U<<3;	// left
+	if (y < ctx.view.clipMin[1]*z) oc |= 1U<<4;	// bottom
+	for (unsigned p=5; p<ctx.view.nb_clipPlanes; p++) {
+		if (plane_h(c3d, ctx.view.clipPlanes+p) < 0) oc |= 1U<<p;
+	}
+	return oc;
 }
 
 static int clip_facet_by_plane(unsigned p)
@@ -144,7 +189,7 @@ static int clip_line_by_plane(unsigned p)
 static int clip_point_by_plane(unsigned p)
 {
 	gpuPlane const *const plane = ctx.view.clipPlanes+p;
-	compute_h(0, plane);
+	compute_h(ctx.points.vectors+0, plane);
 	return ctx.points.vectors[0].h >= 0;
 }
 
@@ -154,28 +199,119 @@ static void next_cache(void)
 	if (cache_depth < CACHE_SIZE-1) cache_depth++;
 }
 
+// Projects c3d into c2d, and returns false if the result is not within the window.
+static bool proj_c3d(int32_t const *c3d, int32_t *c2d)
+{
+	int32_t const x = c3d[0];
+	int32_t const y = c3d[1];
+	int32_t const z = c3d[2];
+	if (z <= ctx.view.clipPlanes[0].origin[2]) return false;
+	int32_t const dproj = ctx.view.dproj;
+	int32_t inv_z = Fix_inv(z);
+	c2d[0] = Fix_mul(x<<dproj, inv_z) + (ctx.view.winWidth<<15);
+	if ((uint32_t)c2d[0] >= (uint32_t)ctx.view.winWidth<<16) return false;
+	c2d[1] = Fix_mul(y<<dproj, inv_z) + (ctx.view.winHeight<<15);
+	return (uint32_t)c2d[1] < (uint32_t)ctx.view.winHeight<<16;
+}
+
+// Projects v if it lands within the guard band, and returns false otherwise.
+static bool proj_guard(gpuVector *v)
+{
+	int32_t const *const c3d = v->cmd->u.geom.c3d;
+	int64_t const z = c3d[2];
+	if (z <= 0) return false;
+	// c2d is (c3d<<dproj)/z, which must lie between clipMin-GUARD_BAND and clipMax+GUARD_BAND
+	for (unsigned c=2; c--; ) {
+		int64_t const x = (int64_t)c3d[c] << ctx.view.dproj;
+		if (x < (ctx.view.clipMin[c]-GUARD_BAND)*z || x > (ctx.view.clipMax[c]+GUARD_BAND)*z) return false;
+	}
+	int32_t const dproj = ctx.view.dproj;
+	int32_t inv_z = Fix_inv(c3d[2]);
+	v->c2d[0] = Fix_mul(c3d[0]<<dproj, inv_z) + (ctx.view.winWidth<<15);
+	v->c2d[1] = Fix_mul(c3d[1]<<dproj, inv_z) + (ctx.view.winHeight<<15);
+	v->proj = 1;
+	v->clipped =
+		(uint32_t)v->c2d[0] >= (uint32_t)ctx.view.winWidth<<16 ||
+		(uint32_t)v->c2d[1] >= (uint32_t)ctx.view.winHeight<<16;
+	return true;
+}
+
+static int64_t floor_div(int64_t n, int64_t d)
+{
+	int64_t q = n / d;
+	if (n % d != 0 && ((n < 0) != (d < 0))) q --;
+	return q;
+}
+
+static int64_t ceil_div(int64_t n, int64_t d)
+{
+	return -floor_div(-n, d);
+}
+
 static void proj_given(unsigned v)
 {
-	int32_t const x = ctx.points.vectors[v].cmd->u.geom.c3d[0];
-	int32_t const y = ctx.points.vectors[v].cmd->u.geom.c3d[1];
-	int32_t const z = ctx.points.vectors[v].cmd->u.geom.c3d[2];
 	ctx.points.vectors[v].clipped = 1;
-	if (z > ctx.view.clipPlanes[0].origin[2]) {
-		int32_t const dproj = ctx.view.dproj;
-		int32_t inv_z = Fix_inv(z);
-		ctx.points.vectors[v].c2d[0] = Fix_mul(x<<dproj, inv_z) + (ctx.view.winWidth<<15);
-		if ((uint32_t)ctx.points.vectors[v].c2d[0] < (uint32_t)ctx.view.winWidth<<16) {
-			ctx.points.vectors[v].c2d[1] = Fix_mul(y<<dproj, inv_z) + (ctx.view.winHeight<<15);
-			if ((uint32_t)ctx.points.vectors[v].c2d[1] < (uint32_t)ctx.view.winHeight<<16) {
-				ctx.points.vectors[v].clipped = 0;
-				ctx.points.vectors[v].proj = 1;
-			}
+	if (proj_c3d(ctx.points.vectors[v].cmd->u.geom.c3d, ctx.points.vectors[v].c2d)) {
+		ctx.points.vectors[v].clipped = 0;
+		ctx.points.vectors[v].proj = 1;
+	}
+}
+
+static struct id_cache_entry *id_cache_set(uint32_t id)
+{
+	if (! id_cache_sets_log) return id_cache;
+	uint32_t const set = (id * 2654435761U) >> (32 - id_cache_sets_log);	// Knuth's multiplicative hash
+	return id_cache + set * ID_CACHE_WAYS;
+}
+
+static void proj_id_cached(unsigned v)
+{
+	uint32_t const id = ctx.points.vectors[v].cmd->same_as;
+	struct id_cache_entry *const set = id_cache_set(id);
+	for (unsigned w=0; w<ID_CACHE_WAYS; w++) {
+		if (set[w].id == id) {
+			id_cache_hit ++;
+			if (id_cache_lru) set[w].age = ++ id_cache_clock;
+			ctx.points.vectors[v].c2d[0] = set[w].x;
+			ctx.points.vectors[v].c2d[1] = set[w].y;
+			ctx.points.vectors[v].clipped = set[w].clipped;
+			ctx.points.vectors[v].proj = 1;
+			return;
 		}
 	}
+	id_cache_miss ++;
+	ctx.points.vectors[v].proj = 0;
+}
+
+static void store_cache(gpuVector const *v)
+{
+	c2d_cache[cache_end].x = v->c2d[0];
+	c2d_cache[cache_end].y = v->c2d[1];
+	c2d_cache[cache_end].clipped = v->clipped;
+	next_cache();
+	uint32_t const id = v->cmd->same_as;
+	if (! (id & GPU_SAME_AS_ID)) return;
+	// Only keep complete projections
+	if (! v->proj || v->clipped) return;
+	struct id_cache_entry *const set = id_cache_set(id);
+	struct id_cache_entry *victim = set;
+	for (unsigned w=0; w<ID_CACHE_WAYS; w++) {
+		if (set[w].id == id) return;	// already there
+		if (set[w].age < victim->age) victim = set+w;
+	}
+	victim->id = id;
+	victim->age = ++ id_cache_clock;
+	victim->x = v->c2d[0];
+	victim->y = v->c2d[1];
+	victim->clipped = v->clipped;
 }
 
 static void proj_cached(unsigned v)
 {
+	if (ctx.points.vectors[v].cmd->same_as & GPU_SAME_AS_ID) {
+		proj_id_cached(v);
+		return;
+	}
 	int const same_as = ctx.points.vectors[v].cmd->same_as - v;
 	if (same_as > 0 && same_as <= cache_depth) {
 		cache_hit ++;
@@ -239,6 +375,28 @@ static void proj_new_vec(gpuVector *v)
 	v->c2d[1] = c2d + (ctx.view.winHeight<<15);
 }
 
+// Compares the bounding box of the projected facet with the scissor rectangle. Returns false if
+// they do not intersect, and asks the rasterizer to scissor the spans if the facet is not inside.
+static bool scissor_facet(void)
+{
+	if (! ctx.view.scissor_rect) return true;
+	gpuVector const *v = ctx.points.first_vector;
+	int32_t c_min[2] = { v->c2d[0], v->c2d[1] };
+	int32_t c_max[2] = { v->c2d[0], v->c2d[1] };
+	do {
+		for (unsigned c=2; c--; ) {
+			if (v->c2d[c] < c_min[c]) c_min[c] = v->c2d[c];
+			if (v->c2d[c] > c_max[c]) c_max[c] = v->c2d[c];
+		}
+		v = v->next;
+	} while (v != ctx.points.first_vector);
+	for (unsigned c=2; c--; ) {
+		if ((c_max[c]>>16) < ctx.view.scissorMin[c] || (c_min[c]>>16) >= ctx.view.scissorMax[c]) return false;
+		if ((c_min[c]>>16) < ctx.view.scissorMin[c] || (c_max[c]>>16) >= ctx.view.scissorMax[c]) ctx.poly.scissor = 1;
+	}
+	return true;
+}
+
 /*
  * Public Functions
  */
@@ -253,9 +411,9 @@ int clip_poly(void)
 	perftime_enter(PERF_CLIP, "clip & proj");
 	// init facet
 	unsigned new_size = ctx.poly.cmd->size;
-	// init vectors
+	// init vectors and their outcodes
 	unsigned v;
-	unsigned clipped = 0;
+	uint32_t out_and = ~0U, out_or = 0;
 	ctx.points.first_vector = ctx.points.vectors + 0;
 	ctx.points.nb_vectors = ctx.poly.cmd->size;
 	for (v=0; v<ctx.points.nb_vectors; v++) {
@@ -263,10 +421,10 @@ int clip_poly(void)
 		ctx.points.vectors[v].prev = &ctx.points.vectors[v-1];
 		ctx.points.vectors[v].clipFlag = 0;
 		proj_cached(v);
-		if (! have_user_clipPlanes()) {	// no user clip planes
-			if (! ctx.points.vectors[v].proj) proj_given(v);
-			clipped |= ctx.points.vectors[v].clipped;
-		}
+		if (! ctx.points.vectors[v].proj) ctx.points.vectors[v].clipped = 1;
+		uint32_t const oc = outcode(ctx.points.vectors+v);
+		out_and &= oc;
+		out_or |= oc;
 #		ifdef GP2X
 		if (ctx.rendering.mode.named.use_intens) {
 			ctx.points.vectors[v].cmd->u.text.i *= 55;
@@ -275,31 +433,67 @@ int clip_poly(void)
 	}
 	ctx.points.vectors[0].prev = &ctx.points.vectors[v-1];
 	ctx.points.vectors[v-1].next = &ctx.points.vectors[0];
-	if (!have_user_clipPlanes() && !clipped) {
-		disp = 1;
+	ctx.poly.scissor = 0;
+	if (out_and) goto ret;	// trivial reject : all vectors are out of the same plane
+	gpuVector *vp;
+	if (! out_or) {	// trivial accept : no clipping needed
+		for (v=0; v<ctx.points.nb_vectors; v++) {
+			vp = ctx.points.vectors+v;
+			if (! vp->proj || vp->clipped) {
+				proj_new_vec(vp);	// clamps the small rounding errors of the outcode
+				vp->proj = 1;
+				vp->clipped = 0;
+			}
+		}
+		disp = scissor_facet();
 		goto ret;
 	}
+	// Clip against the near plane and user planes that are straddled
 	for (v=0; v<ctx.view.nb_clipPlanes; v++) {
+		if (v == 1) v = 5;	// window sides are handled below
+		if (! (out_or & (1U<<v))) continue;
 		if (! clip_facet_by_plane(v)) goto ret;
 	}
-	// compute new size and project new vertexes
+	// If what's left lies within the guard band, there is no need to clip against window sides :
+	// the rasterizer will scissor the spans.
+	bool guarded = true;
+	vp = ctx.points.first_vector;
+	do {
+		if (! vp->proj || vp->clipped) {	// c2d of a clipped vector may be incomplete
+			if (! proj_guard(vp)) {
+				guarded = false;
+				break;
+			}
+			ctx.poly.scissor |= vp->clipped;
+		}
+		vp = vp->next;
+	} while (vp != ctx.points.first_vector);
+	if (! guarded) {
+		ctx.poly.scissor = 0;
+		for (v=1; v<5; v++) {
+			if (! (out_or & (1U<<v))) continue;
+			if (! clip_facet_by_plane(v)) goto ret;
+		}
+	}
+	// compute new size and project new vertexes (when guarded, proj_guard() already projected them all,
+	// and proj_new_vec() would clamp them to the window)
 	new_size = 0;
-	gpuVector *vp = ctx.points.first_vector;
+	vp = ctx.points.first_vector;
 	do {
 		new_size ++;
-		if (! vp->proj) {
+		if (! guarded && (! vp->proj || vp->clipped)) {
 			proj_new_vec(vp);
+			if (! vp->clipFlag) {	// an original vector that was not clipped
+				vp->proj = 1;
+				vp->clipped = 0;
+			}
 		}
 		vp = vp->next;
 	} while (vp != ctx.points.first_vector);
-	disp = 1;
+	disp = scissor_facet();
 ret:
 	for (v=0; v<ctx.poly.cmd->size; v++) {
-		// store it in cache
-		c2d_cache[cache_end].x = ctx.points.vectors[v].c2d[0];
-		c2d_cache[cache_end].y = ctx.points.vectors[v].c2d[1];
-		c2d_cache[cache_end].clipped = ctx.points.vectors[v].clipped;
-		next_cache();
+		store_cache(ctx.points.vectors+v);
 	}
 	ctx.poly.cmd->size = new_size;
 	perftime_enter(previous_target, NULL);
@@ -324,7 +518,8 @@ int clip_point(void)
 			goto ret;
 		}
 	}
-	disp = 1;
+	proj_given(0);
+	disp = !ctx.points.vectors[0].clipped;
 ret:
 	perftime_enter(previous_target, NULL);
 	return disp;
@@ -360,23 +555,90 @@ int clip_line(void)
 	}
 	// project new vertexes
 	for (v=2; v--; ) {
-		if (! ctx.points.vectors[v].proj) {
+		if (! ctx.points.vectors[v].proj || ctx.points.vectors[v].clipped) {
 			proj_new_vec(ctx.points.vectors+v);
 		}
 	}
 	disp = 1;
 ret:
-	for (v=2; v--; ) {	// FIXME: call a store_cache(ctx.points.vectors+v);
-		// store it in cache
-		c2d_cache[cache_end].x = ctx.points.vectors[v].c2d[0];
-		c2d_cache[cache_end].y = ctx.points.vectors[v].c2d[1];
-		c2d_cache[cache_end].clipped = ctx.points.vectors[v].clipped;
-		next_cache();
+	for (v=2; v--; ) {
+		store_cache(ctx.points.vectors+v);
 	}
 	perftime_enter(previous_target, NULL);
 	return disp;
 }
 
+// Projects nb points and rejects those that are out of the window or of user clip planes.
+// The window coordinates of the remaining ones are stored in c2d, and their index in idx.
+// Returns the number of remaining points.
+unsigned clip_points(gpuCmdPointVec const *vec, unsigned nb, int32_t (*c2d)[2], unsigned *idx)
+{
+	unsigned previous_target = perftime_target();
+	perftime_enter(PERF_CLIP, "clip & proj");
+	unsigned nb_in = 0;
+	for (unsigned i=0; i<nb; i++) {
+		for (unsigned p=5; p<ctx.view.nb_clipPlanes; p++) {
+			if (plane_h(vec[i].c3d, ctx.view.clipPlanes+p) < 0) goto next_point;
+		}
+		if (proj_c3d(vec[i].c3d, c2d[nb_in])) {
+			idx[nb_in++] = i;
+		}
+next_point:;
+	}
+	perftime_enter(previous_target, NULL);
+	return nb_in;
+}
+
+// Restricts the current span (starting at c_start, ctx.line.count pixels long) to the window,
+// for polygons that were not clipped against the window sides. Returns how many pixels were skipped
+// at the start of the span, or -1 if nothing is left.
+int32_t scissor_span(int32_t *c_start)
+{
+	unsigned const scan_dir = ctx.rendering.mode.named.perspective ? ctx.poly.scan_dir : 0;
+	int32_t const c_min = ctx.view.scissorMin[scan_dir];
+	int32_t const c_max = ctx.view.scissorMax[scan_dir] - 1;
+	int32_t const nc_min = ctx.view.scissorMin[!scan_dir];
+	int32_t const nc_max = ctx.view.scissorMax[!scan_dir] - 1;
+	int32_t const base = ctx.poly.nc_declived >> 16;
+	int32_t const d = ctx.rendering.mode.named.perspective ? ctx.poly.decliveness : 0;
+	int32_t a = *c_start, b = *c_start + ctx.line.count;
+	if (a < c_min) a = c_min;
+	if (b > c_max) b = c_max;
+	if (b < a) return -1;
+	// The span goes through nc = base + (d*c)>>16, which must be within [nc_min, nc_max]
+	int32_t const nc_a = base + ((d*a)>>16), nc_b = base + ((d*b)>>16);
+	if (nc_a < nc_min || nc_a > nc_max || nc_b < nc_min || nc_b > nc_max) {
+		if (d == 0) return -1;
+		int64_t const lo = (int64_t)(nc_min - base) << 16;	// we want d*c >= lo
+		int64_t const hi = (int64_t)(nc_max + 1 - base) << 16;	// and d*c < hi
+		int64_t a_, b_;
+		if (d > 0) {
+			a_ = ceil_div(lo, d);
+			b_ = ceil_div(hi, d) - 1;
+		} else {
+			a_ = floor_div(hi, d) + 1;
+			b_ = floor_div(lo, d);
+		}
+		if (a_ > a) a = a_;
+		if (b_ < b) b = b_;
+		if (b < a) return -1;
+	}
+	int32_t const skip = a - *c_start;
+	*c_start = a;
+	ctx.line.count = b - a;
+	return skip;
+}
+
+// Moves the params of the current span skip pixels forward.
+void scissor_params(int32_t skip)
+{
+	static int32_t param[GPU_NB_PARAMS];
+	for (unsigned p=sizeof_array(param); p--; ) {
+		param[p] = ctx.line.param[p] + skip*ctx.line.dparam[p];
+	}
+	ctx.line.param = param;
+}
+
 // returns true if something is left to draw
 int cull_poly(void)
 {
@@ -415,6 +677,81 @@ cull_end:
 	return ret;
 }
 
+// Tells the facet orientation before projection, from the sign of the volume of the tetrahedron made of
+// the eye and the first three vertexes, which is also the sign of the projected area computed by cull_poly().
+// Returns 0 if the facet must be culled, 1 if it must be drawn, and -1 if the volume is too close to 0 to tell.
+int cull_poly_3d(void)
+{
+	if (ctx.poly.cmd->cull_mode == 3) return 0;
+	if (ctx.poly.cmd->cull_mode == 0) return 1;
+	int32_t const *const c0 = ctx.points.vectors[0].cmd->u.geom.c3d;
+	int32_t const *const c1 = ctx.points.vectors[1].cmd->u.geom.c3d;
+	int32_t const *const c2 = ctx.points.vectors[2].cmd->u.geom.c3d;
+	// volume is c0.(c1-c0)^(c2-c0)
+	int64_t e1[3], e2[3], n[3];
+	for (unsigned c=3; c--; ) {
+		e1[c] = ((int64_t)c1[c] - c0[c]) >> 2;
+		e2[c] = ((int64_t)c2[c] - c0[c]) >> 2;
+	}
+	n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+	n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+	n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+	// scale n down so that the dot product can't overflow
+	int64_t m = 0;
+	for (unsigned c=3; c--; ) m |= n[c] < 0 ? -n[c] : n[c];
+	unsigned shift = 0;
+	while (m >= (INT64_C(1)<<30)) {
+		m >>= 1;
+		shift ++;
+	}
+	int64_t vol = 0, margin = 0;
+	for (unsigned c=3; c--; ) {
+		int64_t const t = (n[c] >> shift) * c0[c];
+		vol += t;
+		margin += t < 0 ? -t : t;
+	}
+	margin >>= 16;
+	if (vol <= margin && vol >= -margin) return -1;
+	return (vol > 0 && ctx.poly.cmd->cull_mode == GPU_CW) || (vol < 0 && ctx.poly.cmd->cull_mode == GPU_CCW);
+}
+
+// Keeps the projection caches in sync for a facet that is culled before clip_poly().
+// Vertexes that were not cached are stored as clipped, so that they will be projected again if needed.
+void proj_cache_skip(void)
+{
+	unsigned v;
+	for (v=0; v<ctx.poly.cmd->size; v++) {
+		proj_cached(v);
+		if (! ctx.points.vectors[v].proj) ctx.points.vectors[v].clipped = 1;
+	}
+	for (v=0; v<ctx.poly.cmd->size; v++) {
+		store_cache(ctx.points.vectors+v);
+	}
+}
+
+// Tells whether the sphere lies entirely out of one of the clip planes (including user ones).
+bool cull_sphere(int32_t const *center, int32_t radius)
+{
+	for (unsigned p=0; p<ctx.view.nb_clipPlanes; p++) {
+		if (plane_h(center, ctx.view.clipPlanes+p) < -radius) return true;
+	}
+	return false;
+}
+
+// Same for an axis aligned box : we test the corner which is the farthest along the plane normal.
+bool cull_box(int32_t const *min, int32_t const *max)
+{
+	for (unsigned p=0; p<ctx.view.nb_clipPlanes; p++) {
+		gpuPlane const *const plane = ctx.view.clipPlanes+p;
+		int32_t corner[3];
+		for (unsigned c=3; c--; ) {
+			corner[c] = plane->normal[c] >= 0 ? max[c] : min[c];
+		}
+		if (plane_h(corner, plane) < 0) return true;
+	}
+	return false;
+}
+
 unsigned proj_cache_ratio(void)
 {
 	if (cache_hit > (UINT_MAX>>10) || cache_miss > (UINT_MAX>>10)) {
@@ -426,10 +763,48 @@ unsigned proj_cache_ratio(void)
 	return (100*cache_hit)/tot;
 }
 
+// Forgets the vertexes of the 8 entries cache, whose same_as offsets cannot reach across skipped commands.
+void proj_cache_break(void)
+{
+	cache_depth = 0;
+}
+
 void proj_cache_reset(void)
 {
 	cache_end = 0;
 	cache_depth = 0;
 	cache_hit = 0;
 	cache_miss = 0;
+	id_cache_config(GPU_DEFAULT_VCACHE_LOG, true);
+	id_cache_hit = 0;
+	id_cache_miss = 0;
+}
+
+unsigned id_cache_ratio(void)
+{
+	if (id_cache_hit > (UINT_MAX>>10) || id_cache_miss > (UINT_MAX>>10)) {
+		id_cache_hit >>= 1;
+		id_cache_miss >>= 1;
+	}
+	unsigned tot = id_cache_hit+id_cache_miss;
+	if (!tot) return 0;
+	return (100*id_cache_hit)/tot;
+}
+
+// Empties the identifier keyed cache and sets its size (1<<size_log entries) and replacement policy.
+void id_cache_config(unsigned size_log, bool lru)
+{
+	assert(size_log >= 2 && size_log <= ID_CACHE_MAX_LOG);
+	id_cache_sets_log = size_log - 2;	// ID_CACHE_WAYS entries per set
+	id_cache_lru = lru;
+	id_cache_clock = 0;
+	for (unsigned e=0; e<sizeof_array(id_cache); e++) {
+		id_cache[e].id = 0;
+		id_cache[e].age = 0;
+	}
+}
+
+void id_cache_flush(void)
+{
+	id_cache_config(id_cache_sets_log + 2, id_cache_lru);
 }
@@ -22,8 +22,19 @@
 int clip_poly(void);
 int clip_point(void);
 int clip_line(void);
+unsigned clip_points(gpuCmdPointVec const *vec, unsigned nb, int32_t (*c2d)[2], unsigned *idx);
 int cull_poly(void);
+int cull_poly_3d(void);
+void proj_cache_skip(void);
+bool cull_sphere(int32_t const *center, int32_t radius);
+bool cull_box(int32_t const *min, int32_t const *max);
+int32_t scissor_span(int32_t *c_start);
+void scissor_params(int32_t skip);
 unsigned proj_cache_ratio(void);
 void proj_cache_reset(void);
+void proj_cache_break(void);
+unsigned id_cache_ratio(void);
+void id_cache_config(unsigned size_log, bool lru);
+void id_cache_flush(void);
 
 #endif
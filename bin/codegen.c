@@ -98,6 +98,13 @@ static void poke_persp(void);
 static void poke_nopersp(void);
 static void poke_z_persp(void);
 static void poke_z_nopersp(void);
+static void poke16_persp(void);
+static void poke16_nopersp(void);
+static void ztest16_persp(void);
+static void ztest16_nopersp(void);
+static void poke_z16_persp(void);
+static void poke_z16_nopersp(void);
+static void query_count(void);
 static void combine_persp(void);
 static void combine_nopersp(void);
 static void next_persp(void);
@@ -236,6 +243,46 @@ struct {
 		.working_set = 1,
 		.needed_vars = VARP_R_M|VARP_G_M|VARP_B_M|CONSTP_DR_M|CONSTP_DG_M|CONSTP_DB_M,
 		.write_code = next_smooth,
+	}, {
+#		define POKE_OUT16_PERSP 25
+		.working_set = 2,
+		.needed_vars = VARP_OUTCOLOR_M|VARP_W_M|VARP_DECLIV_M,
+		.write_code = poke16_persp,
+	}, {
+#		define POKE_OUT16_NOPERSP 26
+		.working_set = 1,
+		.needed_vars = VARP_OUTCOLOR_M|VARP_W_M,
+		.write_code = poke16_nopersp,
+	}, {	// zbuffer test, 16 bits depth
+#		define ZBUFFER16_PERSP 27
+		.working_set = 2,
+		.needed_vars = CONSTP_Z_M|VARP_W_M|VARP_DECLIV_M|CONSTP_OUT2ZB_M,
+		.write_code = ztest16_persp,
+	}, {	// zbuffer test, 16 bits depth
+#		define ZBUFFER16_NOPERSP 28
+		.working_set = 2,
+		.needed_vars = VARP_Z_M|CONSTP_OUT2ZB_M,
+		.write_code = ztest16_nopersp,
+	}, {
+#		define POKE_Z16_PERSP 29
+		.working_set = 2,
+		.needed_vars = VARP_W_M|CONSTP_Z_M|VARP_DECLIV_M,
+		.write_code = poke_z16_persp,
+	}, {
+#		define POKE_Z16_NOPERSP 30
+		.working_set = 2,
+		.needed_vars = VARP_W_M|VARP_Z_M,
+		.write_code = poke_z16_nopersp,
+	}, {	// count pixels that passed the z test
+#		define QUERY_COUNT 31
+		.working_set = 1,
+		.needed_vars = 0,
+		.write_code = query_count,
+	}, {	// step the trapeze sides (code written by begin_trapeze_loop and end_trapeze_loop)
+#		define TRAPEZE_LOOP 32
+		.working_set = 3,
+		.needed_vars = 0,
+		.write_code = NULL,
 	}
 };
 
@@ -244,6 +291,7 @@ static unsigned working_set, used_set;
 static unsigned nb_pixels_per_loop;
 static uint32_t outcolors_mask, outz_mask;
 static bool in_bh;
+static bool short_spans;	// copied from the stat of the code being generated
 static struct {
 	int var;
 } regs[15];
@@ -280,13 +328,16 @@ static struct {
 	{ .offset = offsetof(struct ctx, line.count), .offset2 = ~0U,},
 	{ .offset = 0, .offset2 = ~0U, },	// VARP_OUTCOLOR, no offset
 };
-static uint32_t *gen_dst, *write_loop_begin, *pixel_loop_begin;
+static uint32_t *gen_dst, *write_loop_begin, *pixel_loop_begin, *line_loop_begin;
+static uint32_t lru_clock;	// incremented each time a code is used
+#define NB_JIT_STATS 32
+static struct jit_stat jit_stats[NB_JIT_STATS];	// usage of the most used keys, kept across evictions
 static unsigned nb_patches;
 struct patches {
 	uint32_t *addr;
 	enum patch_type { offset_24 } type;
-	enum patch_target { next_pixel, bottom_half, restore_quit } target;
-} patches[5];
+	enum patch_target { next_pixel, bottom_half, restore_quit, span_begin } target;
+} patches[8];
 
 /*
  * Private Functions
@@ -306,9 +357,13 @@ static bool may_have_multi_pixels_per_loop(void)
 {
 	return
 		! ctx.rendering.mode.named.perspective && // because we do not write in scanlines then
+		ctx.rendering.mode.named.write_out &&	// because there would be nothing to write at once
+		ctx.location.pix_log[gpuOutBuffer] == 2 &&	// because 16 bits pixels are poked one at a time
 		! may_skip_peek() &&	// because there may be holes
 		! may_skip_poke() &&	// same
-		! ctx.rendering.mode.named.blend_coef;	// because it would be too hard
+		! ctx.rendering.mode.named.write_z &&	// because z is stepped once per loop
+		! ctx.rendering.mode.named.blend_coef &&	// because it would be too hard
+		! short_spans;	// because it would seldom be run
 }
 
 static void add_patch(enum patch_type type, enum patch_target target)
@@ -349,14 +404,14 @@ static void preload_flat(void)
 
 static void begin_write_loop(void)
 {
-	if (!in_bh && nb_pixels_per_loop > 1) {	// test that varp_count >= nb_pixels_per_loop, or jump straight to the "bottom half"
+	if (!in_bh && nb_pixels_per_loop > 1) {	// test that we have nb_pixels_per_loop pixels (varp_count+1) to draw, or jump straight to the "bottom half"
 		assert(nb_pixels_per_loop < 16);
 		assert(vars[VARP_COUNT].rnum != -1);
-		// 1110 0011 0101 count 0000 0000 0000 0000 ie "cmp Rcount, nb_pixels_per_loop"
-		*gen_dst++ = 0xe3500000 | (vars[VARP_COUNT].rnum<<16) | nb_pixels_per_loop;
+		// 1110 0011 0101 count 0000 0000 0000 0000 ie "cmp Rcount, nb_pixels_per_loop-1"
+		*gen_dst++ = 0xe3500000 | (vars[VARP_COUNT].rnum<<16) | (nb_pixels_per_loop-1);
 		add_patch(offset_24, bottom_half);
-		// 0011 1010 0000 0000 0000 0000 0000 0000 ie "blo XXXX"
-		*gen_dst++ = 0x3a000000;
+		// 1011 1010 0000 0000 0000 0000 0000 0000 ie "blt XXXX"
+		*gen_dst++ = 0xba000000;
 	}
 	write_loop_begin = gen_dst;
 }
@@ -372,13 +427,13 @@ static void end_write_loop(void)
 		assert(nb_pixels_per_loop < (1<<8));
 		// 1110 0010 0100 _Rn_ _Rd_ 0000 nbpix loop ie "sub rcount, rcount, #nb_pixels_per_loop"
 		*gen_dst++ = 0xe2400000 | (vars[VARP_COUNT].rnum<<16) | (vars[VARP_COUNT].rnum<<12) | nb_pixels_per_loop;
-		// 1110 0011 0101 _Rn_ 0000 0000 nbpix loop ie "cmp rcount, #nb_pixels_per_loop"
-		*gen_dst++ = 0xe3500000 | (vars[VARP_COUNT].rnum<<16) | nb_pixels_per_loop;
+		// 1110 0011 0101 _Rn_ 0000 0000 nbpix loop ie "cmp rcount, #nb_pixels_per_loop-1"
+		*gen_dst++ = 0xe3500000 | (vars[VARP_COUNT].rnum<<16) | (nb_pixels_per_loop-1);
 		int32_t begin_offset =  (write_loop_begin - (gen_dst+2)) & 0xffffff;
-		// 0010 1010 0000 0000 0000 0000 0000 0000 ie "bhs write_loop_begin"
-		*gen_dst++ = 0x2a000000 | (begin_offset);
-		// 1110 0011 0101 _Rn_ 0000 0000 0000 0000 ie "cmp rcount, #0"
-		*gen_dst++ = 0xe3500000 | (vars[VARP_COUNT].rnum<<16);
+		// 1010 1010 0000 0000 0000 0000 0000 0000 ie "bge write_loop_begin"
+		*gen_dst++ = 0xaa000000 | (begin_offset);
+		// 1110 0011 0111 _Rn_ 0000 0000 0000 0001 ie "cmn rcount, #1" (no pixel left)
+		*gen_dst++ = 0xe3700001 | (vars[VARP_COUNT].rnum<<16);
 		// 0000 1010 0000 0000 0000 0000 0000 0000 ie "beq ret"
 		add_patch(offset_24, restore_quit);
 		*gen_dst++ = 0x0a000000;
@@ -448,8 +503,8 @@ static void ztest_persp(void)
 	// 1110 0001 1010 0000 tmp1 1000 0100 Decliv  ie "mov tmp1, decliv, asr #16"
 	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | vars[VARP_DECLIV].rnum;
 	unsigned const constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp2);
-	// 1110 0000 1000 _RW_ tmp2 0001 0000 out2zb ie "add tmp2, Rw, out2zb, lsl #2"
-	*gen_dst++ = 0xe0800100 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
+	// 1110 0000 1000 _RW_ tmp2 0000 0000 out2zb ie "add tmp2, Rw, out2zb"
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
 	// 1110 0111 1001 tmp2 tmp1 nclo g000 tmp1  ie "ldr tmp1, [tmp2, tmp1, lsl #(nc_log+2)]"
 	*gen_dst++ = 0xe7900000 | (tmp2<<16) | (tmp1<<12) | ((ctx.poly.nc_log+2)<<7) | tmp1;
 	unsigned const constp_z = load_constp(CONSTP_Z, tmp1);
@@ -466,8 +521,8 @@ static void ztest_nopersp(void)
 	assert(nb_pixels_per_loop == 1);
 	unsigned const tmp1 = 0;
 	unsigned const constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp1);
-	// 1110 0111 1001 _RW_ tmp1 0001 0000 out2zb ie "ldr tmp1, [Rw, out2zb, lsl #2]"
-	*gen_dst++ = 0xe7900100 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2zb;
+	// 1110 0111 1001 _RW_ tmp1 0000 0000 out2zb ie "ldr tmp1, [Rw, out2zb]"
+	*gen_dst++ = 0xe7900000 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2zb;
 	// 1110 0001 0101 _RZ_ 0000 0000 0000 tmp1 ie "cmp rz, tmp1"
 	*gen_dst++ = 0xe1500000 | (vars[VARP_Z].rnum<<16) | tmp1;
 	add_patch(offset_24, next_pixel);
@@ -475,6 +530,102 @@ static void ztest_nopersp(void)
 	*gen_dst++ = 0x0a000000 | z_mode_cond();
 }
 
+static void write_depth16(unsigned rdst, unsigned rz)
+{
+	// Maps z into a 16 bits depth, like z_to_depth16() does
+	if (ctx.location.z_shift) {
+		// 1110 0001 1010 0000 rdst shif t100 __rz ie "mov rdst, rz, asr #z_shift"
+		*gen_dst++ = 0xe1a00040 | (rdst<<12) | (ctx.location.z_shift<<7) | rz;
+	} else if (rdst != rz) {
+		// 1110 0001 1010 0000 rdst 0000 0000 __rz ie "mov rdst, rz"
+		*gen_dst++ = 0xe1a00000 | (rdst<<12) | rz;
+	}
+	// 1110 0001 1100 rdst rdst 1111 1100 rdst ie "bic rdst, rdst, rdst, asr #31" ie clamp to 0
+	*gen_dst++ = 0xe1c00fc0 | (rdst<<16) | (rdst<<12) | rdst;
+	// 1110 0011 0101 rdst 0000 1000 0000 0001 ie "cmp rdst, #0x10000"
+	*gen_dst++ = 0xe3500801 | (rdst<<16);
+	// 0010 0011 1010 0000 rdst 1100 1111 1111 ie "movhs rdst, #0xff00"
+	*gen_dst++ = 0x23a00cff | (rdst<<12);
+	// 0010 0011 1000 rdst rdst 0000 1111 1111 ie "orrhs rdst, rdst, #0xff" ie saturate to 0xffff
+	*gen_dst++ = 0x238000ff | (rdst<<16) | (rdst<<12);
+}
+
+static void ztest16_persp(void)
+{
+	assert(! in_bh);
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0, tmp2 = 1;
+	// 1110 0001 1010 0000 tmp1 1000 0100 Decliv  ie "mov tmp1, decliv, asr #16"
+	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | vars[VARP_DECLIV].rnum;
+	unsigned const constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp2);
+	// 1110 0000 1000 _RW_ tmp2 0000 0000 out2zb ie "add tmp2, Rw, out2zb"
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
+	// 1110 0000 1000 tmp2 tmp2 nclo g000 tmp1 ie "add tmp2, tmp2, tmp1, lsl #(nc_log+1)"
+	*gen_dst++ = 0xe0800000 | (tmp2<<16) | (tmp2<<12) | ((ctx.poly.nc_log+1)<<7) | tmp1;
+	// 1110 0001 1101 tmp2 tmp1 0000 1011 0000 ie "ldrh tmp1, [tmp2]"
+	*gen_dst++ = 0xe1d000b0 | (tmp2<<16) | (tmp1<<12);
+	unsigned const constp_z = load_constp(CONSTP_Z, tmp2);
+	write_depth16(tmp2, constp_z);
+	// 1110 0001 0101 tmp2 0000 0000 0000 tmp1 ie "cmp tmp2, tmp1"
+	*gen_dst++ = 0xe1500000 | (tmp2<<16) | tmp1;
+	add_patch(offset_24, next_pixel);
+	// ie "bZOP XXXXX" branch to next_pixel
+	*gen_dst++ = 0x0a000000 | z_mode_cond();
+}
+
+static void ztest16_nopersp(void)
+{
+	assert(! in_bh);
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0, tmp2 = 1;
+	unsigned const constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp1);
+	// 1110 0001 1001 _RW_ tmp1 0000 1011 out2zb ie "ldrh tmp1, [Rw, out2zb]"
+	*gen_dst++ = 0xe19000b0 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2zb;
+	write_depth16(tmp2, vars[VARP_Z].rnum);
+	// 1110 0001 0101 tmp2 0000 0000 0000 tmp1 ie "cmp tmp2, tmp1"
+	*gen_dst++ = 0xe1500000 | (tmp2<<16) | tmp1;
+	add_patch(offset_24, next_pixel);
+	// ie "bZOP XXXXX" branch to next_pixel
+	*gen_dst++ = 0x0a000000 | z_mode_cond();
+}
+
+static void query_count(void)
+{
+	unsigned const tmp1 = 0;
+	unsigned const nb_pixels = in_bh ? 1 : nb_pixels_per_loop;
+	assert(nb_pixels < (1<<8));
+	uint32_t offset = (uint8_t *)(gen_dst+2) - (uint8_t *)&ctx.query.pixels;
+	assert(offset < (1<<12));
+	// 1110 0101 0001 1111 tmp1 offt var_ v__ ie "ldr tmp1, [r15, #-offset]"
+	*gen_dst++ = 0xe51f0000 | (tmp1<<12) | offset;
+	// 1110 0010 1000 tmp1 tmp1 0000 nbpix ie "add tmp1, tmp1, #nb_pixels"
+	*gen_dst++ = 0xe2800000 | (tmp1<<16) | (tmp1<<12) | nb_pixels;
+	offset = (uint8_t *)(gen_dst+2) - (uint8_t *)&ctx.query.pixels;
+	// 1110 0101 0000 1111 tmp1 offt var_ v__ ie "str tmp1, [r15, #-offset]"
+	*gen_dst++ = 0xe50f0000 | (tmp1<<12) | offset;
+}
+
+// insn is a ldr or str from r15 with a negative offset, to which we add r and the offset of var
+static void write_pc_rel(uint32_t insn, unsigned r, void const *var)
+{
+	uint32_t const offset = (uint8_t *)(gen_dst+2) - (uint8_t const *)var;
+	assert(offset < (1<<12));
+	*gen_dst++ = insn | (r<<12) | offset;
+}
+
+// var += dvar, through r and rtmp
+static void write_step(unsigned r, unsigned rtmp, void const *var, void const *dvar)
+{
+	// 1110 0101 0001 1111 Reg_ offt var_ v__ ie "ldr r, [r15, #-offset_var]"
+	write_pc_rel(0xe51f0000, r, var);
+	// 1110 0101 0001 1111 Rtmp offt dvar v__ ie "ldr rtmp, [r15, #-offset_dvar]"
+	write_pc_rel(0xe51f0000, rtmp, dvar);
+	// 1110 0000 1000 Reg_ Reg_ 0000 0000 Rtmp ie "add r, r, rtmp"
+	*gen_dst++ = 0xe0800000 | (r<<16) | (r<<12) | rtmp;
+	// 1110 0101 0000 1111 Reg_ offt var_ v__ ie "str r, [r15, #-offset_var]"
+	write_pc_rel(0xe50f0000, r, var);
+}
+
 static void write_mov_immediate(unsigned r, uint32_t imm)
 {
 	// 1110 0011 1010 0000 tmp2 0000 mask mask ie "mov r, mask"
@@ -662,8 +813,8 @@ static void poke_z_persp(void)
 	// 1110 0001 1010 0000 tmp1 1000 0100 decliv ie "mov tmp1, decliv, asr #16" ie tmp1 = decliv>>16
 	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | vars[VARP_DECLIV].rnum;
 	unsigned constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp2);
-	// 1110 0000 1000 varW tmp2 0001 0000 out2zb ie "add tmp2, varW, constp_out2zb, lsl #2"
-	*gen_dst++ = 0xe0800100 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
+	// 1110 0000 1000 varW tmp2 0000 0000 out2zb ie "add tmp2, varW, constp_out2zb"
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
 	// 1110 0111 1000 tmp2 _RZ_ nclo g000 tmp1 ie "str rz, [tmp2, tmp1, lsl #(nc_log+2)]
 	*gen_dst++ = 0xe7800000 | (tmp2<<16) | (vars[VARP_Z].rnum<<12) | ((ctx.poly.nc_log+2)<<7) | tmp1;
 }
@@ -692,16 +843,89 @@ static void poke_z_nopersp(void)
 	unsigned const tmp1 = 0;
 	unsigned const constp_out2dz = load_constp(CONSTP_OUT2ZB, tmp1);
 	if (in_bh || nb_pixels_per_loop == 1) {
-		// 1110 0111 1000 varW _RZ_ 0001 0000 out2zb ie "str rz, [rW, out2zb, lsl #2]"
-		*gen_dst++ = 0xe7800100 | (vars[VARP_W].rnum<<16) | (vars[VARP_Z].rnum<<12) | constp_out2dz;
+		// 1110 0111 1000 varW _RZ_ 0000 0000 out2zb ie "str rz, [rW, out2zb]"
+		*gen_dst++ = 0xe7800000 | (vars[VARP_W].rnum<<16) | (vars[VARP_Z].rnum<<12) | constp_out2dz;
 	} else {
-		// 1110 0000 1000 _RW_ tmp1 0001 0000 out2zb ie "add tmp1, rW, out2zb, lsl #2"
-		*gen_dst++ = 0xe0800100 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2dz;
+		// 1110 0000 1000 _RW_ tmp1 0000 0000 out2zb ie "add tmp1, rW, out2zb"
+		*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2dz;
 		// 1110 1000 1000 tmp1 regi ster list 16bt ie "smtia tmp1, {rz1-rzN}"
 		*gen_dst++ = 0xe8800000 | (tmp1<<16) | outz_mask;
 	}
 }
 
+static void poke_z16_persp(void)
+{
+	assert(! in_bh);
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0, tmp2 = 1;
+	// 1110 0001 1010 0000 tmp1 1000 0100 decliv ie "mov tmp1, decliv, asr #16" ie tmp1 = decliv>>16
+	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | vars[VARP_DECLIV].rnum;
+	unsigned constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp2);
+	// 1110 0000 1000 varW tmp2 0000 0000 out2zb ie "add tmp2, varW, constp_out2zb"
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp2<<12) | constp_out2zb;
+	// 1110 0000 1000 tmp2 tmp2 nclo g000 tmp1 ie "add tmp2, tmp2, tmp1, lsl #(nc_log+1)"
+	*gen_dst++ = 0xe0800000 | (tmp2<<16) | (tmp2<<12) | ((ctx.poly.nc_log+1)<<7) | tmp1;
+	unsigned const constp_z = load_constp(CONSTP_Z, tmp1);
+	write_depth16(tmp1, constp_z);
+	// 1110 0001 1100 tmp2 tmp1 0000 1011 0000 ie "strh tmp1, [tmp2]"
+	*gen_dst++ = 0xe1c000b0 | (tmp2<<16) | (tmp1<<12);
+}
+
+static void poke_z16_nopersp(void)
+{
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0, tmp2 = 1;
+	write_depth16(tmp1, vars[VARP_Z].rnum);
+	unsigned const constp_out2zb = load_constp(CONSTP_OUT2ZB, tmp2);
+	// 1110 0001 1000 varW tmp1 0000 1011 out2zb ie "strh tmp1, [rW, out2zb]"
+	*gen_dst++ = 0xe18000b0 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | constp_out2zb;
+}
+
+static void write_color16(unsigned rdst, unsigned raddr)
+{
+	// The code is only run on GP2X, where a 16 bits pixel is the Y and either the U (even pixels)
+	// or the V (odd pixels) of the V0UY outcolor.
+	unsigned const rcol = vars[VARP_OUTCOLOR].rnum;
+	// 1110 0011 0001 addr 0000 0000 0000 0010 ie "tst raddr, #2" ie is this an odd pixel ?
+	*gen_dst++ = 0xe3100002 | (raddr<<16);
+	// 0000 0001 1010 0000 rdst 0000 0000 rcol ie "moveq rdst, rcol" ie U<<8 | Y are already in place
+	*gen_dst++ = 0x01a00000 | (rdst<<12) | rcol;
+	// 0001 0011 1100 rcol rdst 1100 1111 1111 ie "bicne rdst, rcol, #0xff00"
+	*gen_dst++ = 0x13c00cff | (rcol<<16) | (rdst<<12);
+	// 0001 0011 1100 rdst rdst 1000 1111 1111 ie "bicne rdst, rdst, #0xff0000" ie rdst = V<<24 | Y
+	*gen_dst++ = 0x13c008ff | (rdst<<16) | (rdst<<12);
+	// 0001 0001 1000 rdst rdst 1000 0010 rdst ie "orrne rdst, rdst, rdst, lsr #16" ie lower half is V<<8 | Y
+	*gen_dst++ = 0x11800820 | (rdst<<16) | (rdst<<12) | rdst;
+}
+
+static void poke16_persp(void)
+{
+	assert(! in_bh);
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0, tmp2 = 1;
+	// 1110 0001 1010 0000 tmp1 1000 0100 decliv ie "mov tmp1, decliv, asr #16" ie tmp1 = decliv>>16
+	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | vars[VARP_DECLIV].rnum;
+	// 1110 0000 1000 varW tmp1 nclo g000 tmp1 ie "add tmp1, varW, tmp1, lsl #(nc_log+1)"
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (tmp1<<12) | ((ctx.poly.nc_log+1)<<7) | tmp1;
+	write_color16(tmp2, tmp1);
+	// 1110 0001 1100 tmp1 tmp2 0000 1011 0000 ie "strh tmp2, [tmp1]"
+	*gen_dst++ = 0xe1c000b0 | (tmp1<<16) | (tmp2<<12);
+}
+
+static void poke16_nopersp(void)
+{
+	assert(nb_pixels_per_loop == 1);
+	unsigned const tmp1 = 0;
+	write_color16(tmp1, vars[VARP_W].rnum);
+	if (! may_skip_poke()) {	// we increment VARP_W on the go, so that we have nothing left for NEXT_NOPERSP
+		// 1110 0000 1100 varW tmp1 0000 1011 0010 ie "strh tmp1, [rW], #2"
+		*gen_dst++ = 0xe0c000b2 | (vars[VARP_W].rnum<<16) | (tmp1<<12);
+	} else {
+		// 1110 0001 1100 varW tmp1 0000 1011 0000 ie "strh tmp1, [rW]"
+		*gen_dst++ = 0xe1c000b0 | (vars[VARP_W].rnum<<16) | (tmp1<<12);
+	}
+}
+
 static void write_combine(void)	// come here with previous color in r0
 {
 	unsigned const tmp1 = 0, tmp2 = 1, tmp3 = 2, tmp4 = 3;
@@ -774,17 +998,17 @@ static void next_persp(void)
 	// 1110 000c0 1000 decliv decliv 0000 0000 ddecliv ie "add decliv, decliv, ddecliv"
 	*gen_dst++ = 0xe0800000 | (vars[VARP_DECLIV].rnum<<16) | (vars[VARP_DECLIV].rnum<<12) | constp_ddecliv;
 	unsigned const constp_dw = load_constp(CONSTP_DW, -1);
-	// 1110 0000 1000 varW varW 0001 0000 _DW_ ie "add varW, varW, constpDW lsl #2
-	*gen_dst++ = 0xe0800100 | (vars[VARP_W].rnum<<16) | (vars[VARP_W].rnum<<12) | constp_dw;
+	// 1110 0000 1000 varW varW pixl og00 _DW_ ie "add varW, varW, constpDW lsl #pix_log
+	*gen_dst++ = 0xe0800000 | (vars[VARP_W].rnum<<16) | (vars[VARP_W].rnum<<12) | (ctx.location.pix_log[gpuOutBuffer]<<7) | constp_dw;
 }
 
 static void next_nopersp(void)
 {
 	do_patch(next_pixel);
-	if (may_skip_poke()) {	// we still have not incremented VARP_W
-		assert(nb_pixels_per_loop = 1);
-		// 1110 0010 1000 varW varW 0000 0000 0100 ie "add varW, varW, #4"
-		*gen_dst++ = 0xe2800004 | (vars[VARP_W].rnum<<16) | (vars[VARP_W].rnum<<12);
+	if (may_skip_poke() || ! ctx.rendering.mode.named.write_out) {	// we still have not incremented VARP_W
+		assert(nb_pixels_per_loop == 1);
+		// 1110 0010 1000 varW varW 0000 0000 0100 ie "add varW, varW, #pixel_size"
+		*gen_dst++ = 0xe2800000 | (vars[VARP_W].rnum<<16) | (vars[VARP_W].rnum<<12) | (1U<<ctx.location.pix_log[gpuOutBuffer]);
 	}
 }
 
@@ -833,13 +1057,18 @@ static void bloc_def_func(void (*cb)(unsigned))
 	) {
 		cb(PRELOAD_FLAT);
 	}
+	if (! ctx.rendering.mode.named.perspective) cb(TRAPEZE_LOOP);
 	cb(BEGIN_WRITE_LOOP);
 	cb(BEGIN_PIXEL_LOOP);
 	// ZBuffer
-	if (ctx.rendering.mode.named.z_mode != gpu_z_off) {
+	if (ctx.rendering.mode.named.z_mode != gpu_z_off && ctx.location.pix_log[gpuZBuffer] == 1) {
+		if (ctx.rendering.mode.named.perspective) cb(ZBUFFER16_PERSP);
+		else cb(ZBUFFER16_NOPERSP);
+	} else if (ctx.rendering.mode.named.z_mode != gpu_z_off) {
 		if (ctx.rendering.mode.named.perspective) cb(ZBUFFER_PERSP);
 		else cb(ZBUFFER_NOPERSP);
 	}
+	if (ctx.query.active) cb(QUERY_COUNT);
 	// Peek color
 	switch ((gpuRenderingType)ctx.rendering.mode.named.rendering_type) {
 		case rendering_flat:
@@ -864,11 +1093,17 @@ static void bloc_def_func(void (*cb)(unsigned))
 	if (ctx.rendering.mode.named.use_intens && ctx.rendering.mode.named.write_out) cb(INTENS);
 	cb(END_PIXEL_LOOP);
 	// Poke
-	if (ctx.rendering.mode.named.write_z) {
+	if (ctx.rendering.mode.named.write_z && ctx.location.pix_log[gpuZBuffer] == 1) {
+		if (ctx.rendering.mode.named.perspective) cb(POKE_Z16_PERSP);
+		else cb(POKE_Z16_NOPERSP);
+	} else if (ctx.rendering.mode.named.write_z) {
 		if (ctx.rendering.mode.named.perspective) cb(POKE_Z_PERSP);
 		else cb(POKE_Z_NOPERSP);
 	}
-	if (ctx.rendering.mode.named.write_out) {
+	if (ctx.rendering.mode.named.write_out && ctx.location.pix_log[gpuOutBuffer] == 1) {
+		if (ctx.rendering.mode.named.perspective) cb(POKE_OUT16_PERSP);
+		else cb(POKE_OUT16_NOPERSP);
+	} else if (ctx.rendering.mode.named.write_out) {
 		if (ctx.rendering.mode.named.perspective) {
 			if (ctx.rendering.mode.named.blend_coef) {
 				cb(COMBINE_PERSP);
@@ -964,6 +1199,62 @@ static void alloc_regs(void)
 	}
 }
 
+// When ctx.line.nb_lines is positive we loop over that many scanlines, stepping the sides and the
+// params from ctx.line, so that a whole trapeze is drawn in one call. Otherwise we draw one span.
+static void begin_trapeze_loop(void)
+{
+	unsigned const tmp1 = 0, tmp2 = 1, tmp3 = 2;
+	// 1110 0101 0001 1111 tmp1 offt var_ v__ ie "ldr tmp1, [r15, #-offset_nb_lines]"
+	write_pc_rel(0xe51f0000, tmp1, &ctx.line.nb_lines);
+	// 1110 0011 0101 tmp1 0000 0000 0000 0000 ie "cmp tmp1, #0"
+	*gen_dst++ = 0xe3500000 | (tmp1<<16);
+	add_patch(offset_24, span_begin);
+	// 1101 1010 0000 0000 0000 0000 0000 0000 ie "ble span_begin"
+	*gen_dst++ = 0xda000000;
+	line_loop_begin = gen_dst;
+	// step only the params we use
+	uint32_t used_params = 0;
+	for (unsigned v = VARP_Z; v <= VARP_I; v++) {
+		if (needed_vars & (1U<<v)) used_params |= 1U << vars[v].offset2;
+	}
+	for (unsigned p=0; p<sizeof_array(ctx.line.left_param); p++) {
+		if (used_params & (1U<<p)) write_step(tmp1, tmp2, &ctx.line.left_param[p], &ctx.line.param_alpha[p]);
+	}
+	write_step(tmp1, tmp2, &ctx.line.c[0], &ctx.line.dc[0]);
+	write_step(tmp3, tmp2, &ctx.line.c[1], &ctx.line.dc[1]);
+	// 1110 0001 1010 0000 tmp1 1000 0100 tmp1 ie "mov tmp1, tmp1, asr #16"
+	*gen_dst++ = 0xe1a00840 | (tmp1<<12) | tmp1;
+	// 1110 0000 0111 tmp1 tmp3 1000 0100 tmp3 ie "rsbs tmp3, tmp1, tmp3, asr #16"
+	*gen_dst++ = 0xe0700840 | (tmp1<<16) | (tmp3<<12) | tmp3;
+	// 1110 0101 0000 1111 tmp3 offt var_ v__ ie "str tmp3, [r15, #-offset_count]"
+	write_pc_rel(0xe50f0000, tmp3, &ctx.line.count);
+	add_patch(offset_24, restore_quit);
+	// 1101 1010 0000 0000 0000 0000 0000 0000 ie "ble restore_quit" (which goes to next line)
+	*gen_dst++ = 0xda000000;
+	// 1110 0101 0001 1111 tmp2 offt var_ v__ ie "ldr tmp2, [r15, #-offset_row]"
+	write_pc_rel(0xe51f0000, tmp2, &ctx.line.row);
+	// 1110 0000 1000 tmp2 tmp2 pixl og00 tmp1 ie "add tmp2, tmp2, tmp1, lsl #pix_log"
+	*gen_dst++ = 0xe0800000 | (tmp2<<16) | (tmp2<<12) | (ctx.location.pix_log[gpuOutBuffer]<<7) | tmp1;
+	// 1110 0101 0000 1111 tmp2 offt var_ v__ ie "str tmp2, [r15, #-offset_w]"
+	write_pc_rel(0xe50f0000, tmp2, (void *)&ctx.line.w);
+	do_patch(span_begin);
+}
+
+static void end_trapeze_loop(void)
+{
+	unsigned const tmp1 = 0, tmp2 = 1;
+	// 1110 0101 0001 1111 tmp1 offt var_ v__ ie "ldr tmp1, [r15, #-offset_nb_lines]"
+	write_pc_rel(0xe51f0000, tmp1, &ctx.line.nb_lines);
+	// 1110 0010 0101 tmp1 tmp1 0000 0000 0001 ie "subs tmp1, tmp1, #1"
+	*gen_dst++ = 0xe2500001 | (tmp1<<16) | (tmp1<<12);
+	// 1010 0101 0000 1111 tmp1 offt var_ v__ ie "strge tmp1, [r15, #-offset_nb_lines]" (so that a span leaves it to 0)
+	write_pc_rel(0xa50f0000, tmp1, &ctx.line.nb_lines);
+	write_step(tmp1, tmp2, &ctx.line.row, &ctx.line.row_dw);
+	int32_t const begin_offset = (line_loop_begin - (gen_dst+2)) & 0xffffff;
+	// 1100 1010 0000 0000 0000 0000 0000 0000 ie "bgt line_loop_begin"
+	*gen_dst++ = 0xca000000 | begin_offset;
+}
+
 static void write_save(void)
 {
 	if (used_set > 4) {
@@ -982,6 +1273,7 @@ static void write_save(void)
 static void write_restore(void)
 {
 	do_patch(restore_quit);
+	if (! ctx.rendering.mode.named.perspective) end_trapeze_loop();
 	if (used_set >= 13) {
 		uint32_t sp_save_offset = (uint8_t *)(gen_dst+2) - (uint8_t *)&ctx.code.sp_save;
 		assert(sp_save_offset < 1<<12);
@@ -1037,6 +1329,7 @@ static void write_block(unsigned block)
 static void write_all(void)
 {
 	write_save();
+	if (! ctx.rendering.mode.named.perspective) begin_trapeze_loop();
 	write_reg_preload();
 	in_bh = false;
 	bloc_def_func(write_block);
@@ -1049,14 +1342,27 @@ static void write_all(void)
 
 static uint64_t get_rendering_key(void)
 {
-	uint32_t key_lo = ctx.rendering.mode.flags;
-	uint32_t key_hi = 0x80000000U;	// so a used key is never 0
-	if (ctx.rendering.mode.named.perspective) key_hi |= ctx.poly.nc_log == 0;
-	if (ctx.rendering.mode.named.rendering_type == rendering_text) {
-		key_hi |= ctx.location.buffer_loc[gpuTxtBuffer].width_log << 1;	// Need 4 bits
-		key_hi |= ctx.location.txt_height_log << 5;	// Need also 4 bits
-	}
-	return ((uint64_t)key_hi<<32) | key_lo;
+	return jit_rendering_key(ctx.rendering.mode, ctx.location.pix_log, ctx.location.z_shift, ctx.location.buffer_loc[gpuTxtBuffer].width_log, ctx.location.txt_height_log);
+}
+
+// Sets the rendering context from which get_rendering_key() would compute this key.
+// Returns false if this is not a key get_rendering_key() may return.
+static bool set_rendering_key(uint64_t key)
+{
+	uint32_t const key_lo = key, key_hi = key>>32;
+	ctx.rendering.mode.flags = key_lo;
+	if (
+		ctx.rendering.mode.named.rendering_type > rendering_smooth ||
+		ctx.rendering.mode.named.z_mode > gpu_z_gte
+	) return false;
+	ctx.poly.nc_log = (key_hi >> 17) & 0x1f;
+	ctx.location.buffer_loc[gpuTxtBuffer].width_log = (key_hi >> 1) & 0xf;
+	ctx.location.txt_height_log = (key_hi >> 5) & 0xf;
+	ctx.location.pix_log[gpuOutBuffer] = key_hi & (1U << 9) ? 1:2;
+	ctx.location.pix_log[gpuZBuffer] = key_hi & (1U << 10) ? 1:2;
+	ctx.location.z_shift = (key_hi >> 11) & 0x1f;
+	ctx.query.active = (key_hi >> 16) & 1;
+	return get_rendering_key() == key;
 }
 
 #if defined(TEST_RASTERIZER) && !defined(GP2X)
@@ -1069,6 +1375,9 @@ static uint64_t get_rendering_key(void)
 #	include <errno.h>
 #	include <inttypes.h>
 #endif
+#ifdef CHECK_RASTERIZER
+#	include "armemu.h"
+#endif
 
 void build_code(unsigned cache)
 {
@@ -1079,14 +1388,16 @@ void build_code(unsigned cache)
 	}
 	// init other global vars
 	gen_dst = ctx.code.caches[cache].buf;
-	write_loop_begin = pixel_loop_begin = NULL;
+	short_spans = ctx.code.caches[cache].stat->short_spans;
+	write_loop_begin = pixel_loop_begin = line_loop_begin = NULL;
 	nb_patches = 0;
 	bloc_def_func(look_regs);
 	alloc_regs();
 	write_all();
-#	if defined(TEST_RASTERIZER) && !defined(GP2X)
 	unsigned nb_words = gen_dst - ctx.code.caches[cache].buf;
-	assert(nb_words <= sizeof_array(ctx.code.caches[cache].buf));
+	assert(nb_words <= MAX_CODE_SIZE);
+	ctx.code.caches[cache].size = nb_words;
+#	if defined(TEST_RASTERIZER) && !defined(GP2X)
 	static char fname[PATH_MAX];
 	snprintf(fname, sizeof(fname), "/tmp/codegen_%"PRIx64, ctx.code.caches[cache].rendering_key);
 	int fd = open(fname, O_WRONLY|O_CREAT, 0644);
@@ -1125,47 +1436,357 @@ void flush_cache(void)
 #	endif
 }
 
+static struct jit_stat *get_stat(uint64_t key)
+{
+	struct jit_stat *victim = jit_stats;
+	for (unsigned s=0; s<sizeof_array(jit_stats); s++) {
+		if (jit_stats[s].rendering_key == key) return jit_stats+s;
+		if (jit_stats[s].hits + jit_stats[s].builds < victim->hits + victim->builds) victim = jit_stats+s;
+	}
+	victim->rendering_key = key;
+	victim->hits = victim->builds = victim->size = victim->errors = 0;
+	victim->insns = victim->pixels = 0;
+	victim->pixels_per_loop = victim->nb_spans = 0;
+	for (unsigned c=0; c<sizeof_array(victim->spans); c++) victim->spans[c] = 0;
+	victim->profiled = victim->short_spans = 0;
+	return victim;
+}
+
+// Returns a free cache entry which buf points to at least MAX_CODE_SIZE free words of the arena,
+// evicting the least recently used codes until there is one (or returning NULL if may_evict is not set).
+static struct jit_cache *alloc_cache(bool may_evict)
+{
+	while (1) {
+		struct jit_cache *free_entry = NULL, *lru = NULL;
+		struct jit_cache *used[NB_CODE_CACHE];
+		unsigned nb_used = 0;
+		for (unsigned r=0; r<sizeof_array(ctx.code.caches); r++) {
+			struct jit_cache *const c = ctx.code.caches+r;
+			if (! c->rendering_key) {
+				free_entry = c;
+				continue;
+			}
+			if (! lru || c->last_use < lru->last_use) lru = c;
+			// keep used entries sorted by address
+			unsigned i = nb_used++;
+			while (i > 0 && used[i-1]->buf > c->buf) {
+				used[i] = used[i-1];
+				i --;
+			}
+			used[i] = c;
+		}
+		if (free_entry) {
+			// look for a gap between used codes
+			uint32_t *start = ctx.code.arena;
+			for (unsigned i=0; i<=nb_used; i++) {
+				uint32_t *const stop = i < nb_used ? used[i]->buf : ctx.code.arena + CODE_ARENA_SIZE;
+				if (stop - start >= MAX_CODE_SIZE) {
+					free_entry->buf = start;
+					return free_entry;
+				}
+				if (i < nb_used) start = used[i]->buf + used[i]->size;
+			}
+		}
+		if (! may_evict) return NULL;
+		assert(lru);
+		if (ctx.rendering.rasterizer == lru) ctx.rendering.rasterizer = NULL;
+		lru->rendering_key = 0;
+	}
+}
+
+#ifdef CHECK_RASTERIZER
+// Draw with raster_gen() what the generated code is asked to draw. Returns the number of pixels.
+static unsigned check_reference(void)
+{
+	if (ctx.line.nb_lines <= 0) {
+		raster_gen();
+		return ctx.line.count + 1;
+	}
+	unsigned nb_pixels = 0;
+	for ( ; ctx.line.nb_lines > 0; ctx.line.nb_lines--) {	// same steps than begin_trapeze_loop()
+		for (unsigned p=sizeof_array(ctx.line.left_param); p--; ) {
+			ctx.line.left_param[p] += ctx.line.param_alpha[p];
+		}
+		ctx.line.c[0] += ctx.line.dc[0];
+		ctx.line.c[1] += ctx.line.dc[1];
+		int32_t const c_start = ctx.line.c[0] >> 16;
+		ctx.line.count = (ctx.line.c[1] >> 16) - c_start;
+		if (ctx.line.count > 0) {
+			ctx.line.w = ctx.line.row + (c_start << ctx.location.pix_log[gpuOutBuffer]);
+			raster_gen();
+			nb_pixels += ctx.line.count + 1;
+		}
+		ctx.line.row += ctx.line.row_dw;
+	}
+	return nb_pixels;
+}
+
+// Bytes of the out buffer that may be written, from lo to hi excluded.
+static void check_range(uint8_t **lo, uint8_t **hi)
+{
+	unsigned const out_log = ctx.location.pix_log[gpuOutBuffer];
+	if (ctx.line.nb_lines > 0) {
+		*lo = ctx.line.row;
+		*hi = ctx.line.row + ctx.line.nb_lines * ctx.line.row_dw;
+	} else if (ctx.rendering.mode.named.perspective) {
+		uint8_t *w = ctx.line.w;
+		int32_t decliv = ctx.line.decliv;
+		*lo = *hi = w;
+		for (int count = ctx.line.count; count >= 0; count--) {
+			uint8_t *const p = w + (((decliv>>16)<<ctx.poly.nc_log)<<out_log);
+			if (p < *lo) *lo = p;
+			if (p + (1<<out_log) > *hi) *hi = p + (1<<out_log);
+			w += ctx.line.dw << out_log;
+			decliv += ctx.poly.decliveness;
+		}
+	} else {
+		*lo = ctx.line.w;
+		*hi = ctx.line.w + ((ctx.line.count + 1) << out_log);
+	}
+}
+#endif
+
+static bool can_generate(void)
+{
+	// z-buffer must use the same pixel size than the out buffer so that out2zb stands.
+	if (
+		(ctx.rendering.mode.named.z_mode != gpu_z_off || ctx.rendering.mode.named.write_z) &&
+		ctx.location.pix_log[gpuZBuffer] != ctx.location.pix_log[gpuOutBuffer]
+	) return false;
+	if (ctx.location.pix_log[gpuOutBuffer] == 2) return true;
+	// 16 bits pixels are poked with no blending.
+	if (ctx.rendering.mode.named.write_out && (ctx.rendering.mode.named.blend_coef || ctx.rendering.mode.named.use_txt_blend)) return false;
+	return true;
+}
+
 /*
  * Public Functions
  */
 
-struct jit_cache *jit_prepare_rasterizer(void)
+// Once enough spans were counted, tells whether most of them were too short to run the unrolled
+// loop even once. Returns true if the code must be generated again.
+static bool profile(struct jit_stat *stat)
+{
+	if (stat->profiled || stat->nb_spans < JIT_PROFILE_SPANS) return false;
+	stat->profiled = 1;
+	if (stat->pixels_per_loop <= 1) return false;
+	uint32_t nb_short = 0;
+	for (unsigned c=0; c<sizeof_array(stat->spans) && (2U<<c)-1 < stat->pixels_per_loop; c++) {
+		nb_short += stat->spans[c];
+	}
+	if (nb_short <= stat->nb_spans/2) return false;
+	stat->short_spans = 1;
+	return true;
+}
+
+static struct jit_cache *find_cache(uint64_t key)
 {
-	uint64_t key = get_rendering_key();
-	int r_dest = -1;
 	for (unsigned r=0; r<sizeof_array(ctx.code.caches); r++) {
-		if (ctx.code.caches[r].rendering_key == key) {
-			ctx.code.caches[r].use_count ++;
-			return ctx.code.caches+r;
-		}
-		if (ctx.code.caches[r].rendering_key == 0) {
-			r_dest = r;
-		}
+		if (ctx.code.caches[r].rendering_key == key) return ctx.code.caches+r;
 	}
-	// not found
-	if (r_dest == -1) {
-		// free the least used
-		uint32_t min_use_count = UINT32_MAX;
-		for (unsigned r = 0; r<sizeof_array(ctx.code.caches); r++) {
-			if (ctx.code.caches[r].use_count < min_use_count) {
-				min_use_count = ctx.code.caches[r].use_count;
-				r_dest = r;
-			}
-			ctx.code.caches[r].use_count = 0;
+	return NULL;
+}
+
+// Lists the key in shared memory, so that the client can save it and ask for it with gpuPRECOMPILE
+static void remember_key(uint64_t key)
+{
+	unsigned k;
+	for (k=0; k<GPU_NB_JIT_KEYS && (shared->jit_keys[2*k] || shared->jit_keys[2*k+1]); k++) {
+		if (shared->jit_keys[2*k] == (uint32_t)key && shared->jit_keys[2*k+1] == (uint32_t)(key>>32)) return;
+	}
+	if (k == GPU_NB_JIT_KEYS) return;	// keep the first ones
+	shared->jit_keys[2*k] = key;
+	shared->jit_keys[2*k+1] = key>>32;
+}
+
+// Generates the code for the current rendering context, which key is given.
+static struct jit_cache *new_code(uint64_t key, bool may_evict)
+{
+	unsigned previous_target = perftime_target();
+	perftime_enter(PERF_JIT, "codegen");
+	struct jit_cache *cache = alloc_cache(may_evict);
+	if (cache) {
+		cache->rendering_key = key;
+		cache->last_use = ++ lru_clock;
+		cache->stat = get_stat(key);
+		(void)profile(cache->stat);
+		build_code(cache - ctx.code.caches);
+		flush_cache();
+		cache->stat->builds ++;
+		cache->stat->size = cache->size;
+		cache->stat->pixels_per_loop = nb_pixels_per_loop;
+		remember_key(key);
+	}
+	perftime_enter(previous_target, NULL);
+	return cache;
+}
+
+// Key of the code for this mode and these buffers, other parameters being those of ctx
+uint64_t jit_rendering_key(gpuMode mode, uint32_t const *pix_log, uint32_t z_shift, uint32_t txt_width_log, uint32_t txt_height_log)
+{
+	uint32_t key_lo = mode.flags;
+	uint32_t key_hi = 0x80000000U;	// so a used key is never 0
+	if (mode.named.perspective) key_hi |= ctx.poly.nc_log << 17;	// out width_log, or 0 if scanning columns. Need 5 bits
+	if (mode.named.rendering_type == rendering_text) {
+		key_hi |= txt_width_log << 1;	// Need 4 bits
+		key_hi |= txt_height_log << 5;	// Need also 4 bits
+	}
+	key_hi |= (pix_log[gpuOutBuffer] == 1) << 9;
+	if (
+		(mode.named.z_mode != gpu_z_off || mode.named.write_z) &&
+		pix_log[gpuZBuffer] == 1
+	) {
+		key_hi |= 1U << 10;
+		key_hi |= z_shift << 11;	// Need 5 bits
+	}
+	key_hi |= ctx.query.active << 16;
+	return ((uint64_t)key_hi<<32) | key_lo;
+}
+
+struct jit_cache *jit_prepare_rasterizer(void)
+{
+	if (! can_generate()) return NULL;	// jit_exec() will use raster_gen()
+	uint64_t key = get_rendering_key();
+	struct jit_cache *cache = ctx.rendering.rasterizer;
+	if (! cache || cache->rendering_key != key) cache = find_cache(key);
+	if (cache) {
+		cache->last_use = ++ lru_clock;
+		if (cache->stat->rendering_key != key) cache->stat = get_stat(key);	// stat entry was recycled
+		cache->stat->hits ++;
+		if (profile(cache->stat)) {	// generate it again, without unrolling
+			if (ctx.rendering.rasterizer == cache) ctx.rendering.rasterizer = NULL;
+			cache->rendering_key = 0;
+			return new_code(key, true);
 		}
+		return cache;
 	}
-	ctx.code.caches[r_dest].use_count = 1;
-	ctx.code.caches[r_dest].rendering_key = key;
-	build_code(r_dest);
-	flush_cache();
-	return ctx.code.caches+r_dest;
+	return new_code(key, true);
 }
 
-void jit_invalidate(void)	// TODO: give hint as to what invalidate
+// Generates the code for this rendering key ahead of time, if it's valid and fits in the arena
+// without evicting anything. Returns false if the key was not valid.
+bool jit_precompile(uint64_t key)
+{
+	gpuMode const mode = ctx.rendering.mode;
+	uint32_t const nc_log = ctx.poly.nc_log;
+	uint32_t const query_active = ctx.query.active;
+	uint32_t const txt_width_log = ctx.location.buffer_loc[gpuTxtBuffer].width_log;
+	uint32_t const txt_height_log = ctx.location.txt_height_log;
+	uint32_t const out_pix_log = ctx.location.pix_log[gpuOutBuffer];
+	uint32_t const z_pix_log = ctx.location.pix_log[gpuZBuffer];
+	uint32_t const z_shift = ctx.location.z_shift;
+	bool const valid = set_rendering_key(key);
+	if (valid && can_generate() && ! find_cache(key)) (void)new_code(key, false);
+	ctx.rendering.mode = mode;
+	ctx.poly.nc_log = nc_log;
+	ctx.query.active = query_active;
+	ctx.location.buffer_loc[gpuTxtBuffer].width_log = txt_width_log;
+	ctx.location.txt_height_log = txt_height_log;
+	ctx.location.pix_log[gpuOutBuffer] = out_pix_log;
+	ctx.location.pix_log[gpuZBuffer] = z_pix_log;
+	ctx.location.z_shift = z_shift;
+	return valid;
+}
+
+// Everything the generated codes depend on is part of their rendering key (the width of the out
+// buffer included, which perspective codes use to step across lines), so that nothing but a reset
+// needs to drop them : other buffers or modes just select other entries.
+void jit_invalidate(void)
 {
 	for (unsigned r=0; r<sizeof_array(ctx.code.caches); r++) {
 		ctx.code.caches[r].rendering_key = 0;	// meaning : not set
 	}
+	for (unsigned s=0; s<sizeof_array(jit_stats); s++) {
+		jit_stats[s].rendering_key = 0;
+		jit_stats[s].hits = jit_stats[s].builds = jit_stats[s].size = jit_stats[s].errors = 0;
+		jit_stats[s].insns = jit_stats[s].pixels = 0;
+		jit_stats[s].pixels_per_loop = jit_stats[s].nb_spans = 0;
+		for (unsigned c=0; c<sizeof_array(jit_stats[s].spans); c++) jit_stats[s].spans[c] = 0;
+		jit_stats[s].profiled = jit_stats[s].short_spans = 0;
+	}
+	lru_clock = 0;
+}
+
+// Fills stats with the (at most max) most used keys, most used first. Returns how many were found.
+unsigned jit_top_stats(struct jit_stat const **stats, unsigned max)
+{
+	unsigned nb = 0;
+	for (unsigned s=0; s<sizeof_array(jit_stats); s++) {
+		if (! jit_stats[s].rendering_key) continue;
+		// insertion sort
+		unsigned i = nb < max ? nb++ : max;
+		while (i > 0 && stats[i-1]->hits < jit_stats[s].hits) {
+			if (i < max) stats[i] = stats[i-1];
+			i --;
+		}
+		if (i < max) stats[i] = jit_stats+s;
+	}
+	return nb;
+}
+
+#ifdef CHECK_RASTERIZER
+// Runs the prepared code in the ARM interpreter, after having drawn the same thing with raster_gen()
+// so that both out and z buffers can be compared. What raster_gen() drew is kept.
+void jit_check(void)
+{
+	struct jit_cache *const cache = ctx.rendering.rasterizer;
+	bool const use_z = ctx.rendering.mode.named.z_mode != gpu_z_off || ctx.rendering.mode.named.write_z;
+	// Generated codes compute and blend colors as YUV, as on GP2X, while raster_gen() uses RGB on PC :
+	// only compare the out buffer when colors are computed alike.
+	bool const same_colors =
+		ctx.rendering.mode.named.rendering_type != rendering_smooth &&
+		! ctx.rendering.mode.named.use_intens &&
+		! ctx.rendering.mode.named.blend_coef &&
+		! ctx.rendering.mode.named.use_txt_blend &&
+		ctx.location.pix_log[gpuOutBuffer] == 2;
+	uint8_t *lo, *hi;
+	check_range(&lo, &hi);
+	size_t const len = hi - lo;
+	static uint8_t *copies;	// saved out, saved z, reference out, reference z
+	static size_t copies_len;
+	if (len > copies_len) {
+		copies = realloc(copies, 4 * len);
+		assert(copies);
+		copies_len = len;
+	}
+	uint8_t *const saved = copies, *const ref = copies + 2*len;
+	memcpy(saved, lo, len);
+	if (use_z) memcpy(saved + len, lo + ctx.code.out2zb, len);
+	uint8_t line[sizeof(ctx.line)];
+	memcpy(line, &ctx.line, sizeof(line));
+	uint32_t const query_pixels = ctx.query.pixels;
+	// reference
+	unsigned const nb_pixels = check_reference();
+	uint32_t const ref_query_pixels = ctx.query.pixels;
+	memcpy(ref, lo, len);
+	memcpy(lo, saved, len);
+	if (use_z) {
+		memcpy(ref + len, lo + ctx.code.out2zb, len);
+		memcpy(lo + ctx.code.out2zb, saved + len, len);
+	}
+	memcpy(&ctx.line, line, sizeof(line));
+	ctx.query.pixels = query_pixels;
+	// generated code
+	struct arm_region const regions[] = {
+		{ .base = &ctx, .size = sizeof(ctx) },
+		{ .base = shared, .size = sizeof(*shared) },
+	};
+	unsigned const nb_insns = arm_run(cache->buf, regions, sizeof_array(regions));
+	cache->stat->insns += nb_insns;
+	cache->stat->pixels += nb_pixels;
+	if (
+		(same_colors && memcmp(ref, lo, len)) ||
+		(use_z && memcmp(ref + len, lo + ctx.code.out2zb, len)) ||
+		ctx.query.pixels != ref_query_pixels
+	) {
+		cache->stat->errors ++;
+		fprintf(stderr, "Code for key %"PRIx64" does not draw what raster_gen() draws\n", cache->rendering_key);
+	}
+	// The generated code drew YUV colors : put back the reference, in the colors of the PC
+	memcpy(lo, ref, len);
+	if (use_z) memcpy(lo + ctx.code.out2zb, ref + len, len);
+	ctx.query.pixels = ref_query_pixels;
 }
+#endif
 
 extern inline void jit_exec(void);
@@ -19,16 +19,64 @@
 #define CODEGEN_H_061026
 
 #define TEST_RASTERIZER
+#define JIT_VERSION 2	// to increment whenever generated codes or rendering keys change
+// Build with -DCHECK_RASTERIZER on PC to run generated codes in armemu.c and check them against raster_gen()
 
+#define JIT_NB_SPAN_CLASSES 8
+#define JIT_PROFILE_SPANS 1024	// spans to count before choosing how to loop over pixels
+
+struct jit_stat {
+	uint64_t rendering_key;
+	uint32_t hits;	// times the code was found in the cache
+	uint32_t builds;	// times it was generated (more than once if it was evicted)
+	uint32_t size;	// in words
+	uint32_t pixels_per_loop;	// of the last generated code
+	uint32_t spans[JIT_NB_SPAN_CLASSES];	// spans drawn without perspective, by log2 of their length
+	uint32_t nb_spans;
+	uint32_t profiled:1;	// set once spans were counted enough to choose
+	uint32_t short_spans:1;	// do not unroll the pixel loop, since most spans are too short for it
+	uint32_t errors;	// times the code did not draw what raster_gen() draws (CHECK_RASTERIZER only)
+	uint64_t insns, pixels;	// executed instructions and drawn pixels (CHECK_RASTERIZER only)
+};
+
+uint64_t jit_rendering_key(gpuMode mode, uint32_t const *pix_log, uint32_t z_shift, uint32_t txt_width_log, uint32_t txt_height_log);
 struct jit_cache *jit_prepare_rasterizer(void);
+bool jit_precompile(uint64_t key);
 void jit_invalidate(void);
+unsigned jit_top_stats(struct jit_stat const **stats, unsigned max);
+#ifdef CHECK_RASTERIZER
+void jit_check(void);
+#endif
+// Counts nb spans of this length (in pixels) in the stats of the prepared code
+static inline void jit_count_spans(int32_t length, uint32_t nb)
+{
+	struct jit_cache *const cache = ctx.rendering.rasterizer;
+	if (! cache || length <= 0) return;
+	unsigned c = 0;
+	while (length > 1 && c < JIT_NB_SPAN_CLASSES-1) {	// no clz on the 940
+		length >>= 1;
+		c ++;
+	}
+	cache->stat->spans[c] += nb;
+	cache->stat->nb_spans += nb;
+}
+
 static inline void jit_exec(void)
 {
-#	ifdef GP2X
-	typedef void (*rasterizer_func)(void);
-	rasterizer_func const rasterizer = (rasterizer_func const)ctx.rendering.rasterizer->buf;
-	rasterizer();
+#	if defined(GP2X)
+	if (likely(ctx.rendering.rasterizer)) {
+		typedef void (*rasterizer_func)(void);
+		rasterizer_func const rasterizer = (rasterizer_func const)ctx.rendering.rasterizer->buf;
+		rasterizer();
+		return;
+	}
+#	elif defined(CHECK_RASTERIZER)
+	if (likely(ctx.rendering.rasterizer)) {
+		jit_check();
+		return;
+	}
 #	endif
+	raster_gen();	// no generated code for this rendering
 }
 
 #endif
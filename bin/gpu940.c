@@ -52,20 +52,30 @@ volatile uint32_t *gp2x_regs = (void *)(0xC0000000U-0x2000000U);	// 32-bit versi
 #else
 static SDL_Surface *sdl_screen;
 #endif
-static struct buffer_loc displist[GPU_DISPLIST_SIZE+1];
+static struct displist_entry {
+	struct buffer_loc loc;
+	struct clear_tag clear;	// bands that were still to be cleared when the buffer was queued
+} displist[GPU_DISPLIST_SIZE+1];
 static unsigned displist_begin = 0, displist_end = 0;	// same convention than for shared->cmds
+static struct pipeline {
+	bool defined;
+	gpuCmdSetPipeline set;	// with a clean mode
+	struct jit_cache *rasterizer;	// prepared when last bound
+} pipelines[GPU_NB_PIPELINES];
 
 /*
  * Private Functions
  */
 
-static void display(struct buffer_loc const *loc) {
+static void display(struct displist_entry const *entry) {
+	struct buffer_loc const *const loc = &entry->loc;
 	// display current workingBuffer
 	int previous_target = perftime_target();
 	perftime_enter(PERF_DISPLAY, "display");
+	unsigned const pix_log = loc->format == gpuFmt16 ? 1:2;
 #ifdef GP2X
 	static unsigned previous_width = 0;
-	unsigned width = 1<<(1+loc->width_log);
+	unsigned width = 1<<(pix_log-1+loc->width_log);	// in half words
 	if (width != previous_width) {
 //		gp2x_regs16[0x290c>>1] = width;
 		gp2x_regs16[0x288a>>1] = width&0xffff;	// V scale ratio
@@ -73,7 +83,9 @@ static void display(struct buffer_loc const *loc) {
 		gp2x_regs16[0x2892>>1] = width;
 		previous_width = width;
 	}
-	uint32_t screen_addr = (uint32_t)&((struct gpuShared *)SHARED_PHYSICAL_ADDR)->buffers[loc->address + (ctx.view.winPos[1]<<loc->width_log) + ctx.view.winPos[0]];
+	// H Scaling of top region A : a 32 bits pixel is displayed as a whole macropixel
+	gp2x_regs16[0x2886>>1] = 1024<<(loc->format == gpuFmt32);
+	uint32_t screen_addr = (uint32_t)&((struct gpuShared *)SHARED_PHYSICAL_ADDR)->buffers[loc->address] + (((ctx.view.winPos[1]<<loc->width_log) + ctx.view.winPos[0]) << pix_log);
 //	gp2x_regs16[0x28a0>>1] = screen_addr&0xffff;	// odd	seams useless
 //	gp2x_regs16[0x28a2>>1] = screen_addr>>16;	// odd
 	gp2x_regs16[0x28a4>>1] = screen_addr&0xffff;	// even
@@ -87,8 +99,26 @@ static void display(struct buffer_loc const *loc) {
 	// draw...
 	for (y = SCREEN_HEIGHT; y--; ) {
 		Uint32 *restrict dst = (Uint32*)((Uint8*)sdl_screen->pixels + y*sdl_screen->pitch);
-		uint32_t *restrict src = &shared->buffers[loc->address + ((y+ctx.view.winPos[1])<<loc->width_log) + ctx.view.winPos[0]];
-		memcpy(dst, src, SCREEN_WIDTH<<2);
+		uint8_t const *restrict src = (uint8_t *)&shared->buffers[loc->address] + ((((y+ctx.view.winPos[1])<<loc->width_log) + ctx.view.winPos[0]) << pix_log);
+		struct clear_tag const *const clear = &entry->clear;
+		unsigned const row = y+ctx.view.winPos[1];
+		if (clear->pending && (row >> clear->band_log) < 32 && (clear->pending & (1U << (row >> clear->band_log)))) {	// this row is still to be cleared
+			for (unsigned x = 0; x < SCREEN_WIDTH; x++) {
+				unsigned const col = x+ctx.view.winPos[0];
+				if (col - clear->x_start < clear->width) {
+					dst[x] = pix_log == 1 ? color_16to32(clear->fill[col&1], col&1) : clear->fill[0];
+				} else {
+					dst[x] = pix_log == 1 ? color_16to32(((uint16_t const *)src)[x], pixel_is_odd(src+(x<<1))) : ((uint32_t const *)src)[x];
+				}
+			}
+		} else if (loc->format == gpuFmt16) {
+			uint16_t const *restrict src16 = (uint16_t const *)src;
+			for (unsigned x = 0; x < SCREEN_WIDTH; x++) {
+				dst[x] = color_16to32(src16[x], pixel_is_odd(src16+x));
+			}
+		} else {
+			memcpy(dst, src, SCREEN_WIDTH<<2);
+		}
 	}
 	if (SDL_MUSTLOCK(sdl_screen)) SDL_UnlockSurface(sdl_screen);
 	if (console_enabled) SDL_BlitSurface(sdl_console, NULL, sdl_screen, NULL);
@@ -115,8 +145,13 @@ static void console_setup(void) {
 	console_write(0, 1, "FrmCount:");
 	console_write(20, 1, "FrmMiss :");
 	console_write(0, 2, "ProjCach:");
+	console_write(20, 2, "VtxCach :");
 	console_write(0, 3, "Perfmeter        \xb3  nb enter  \xb3 lavg");
 	console_write(0, 4, "\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc5\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc5\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4\xc4");
+	console_write(0, 16, "JIT key         \xb3  hits  \xb3" "build" "\xb3" "siz");
+#	ifdef CHECK_RASTERIZER
+	console_write(35, 16, "\xb3" "i/px");
+#	endif
 }
 static void console_stat(int y, int target) {
 #	ifndef NDEBUG
@@ -133,6 +168,26 @@ static void console_stat(int y, int target) {
 	(void)target;
 #	endif
 }
+static void console_jit(int y) {
+#	define CONSOLE_NB_KEYS 8
+	struct jit_stat const *stats[CONSOLE_NB_KEYS];
+	unsigned const nb = jit_top_stats(stats, CONSOLE_NB_KEYS);
+	console_clear_rect(0, y, 0, CONSOLE_NB_KEYS);
+	for (unsigned s=0; s<nb; s++) {
+		console_write_uint(0, y+s, 10, stats[s]->rendering_key);	// mode flags
+		console_write_uint(11, y+s, 5, (stats[s]->rendering_key>>32) & 0xffff);
+		console_setcolor(2); console_write(16, y+s, "\xb3"); console_setcolor(3);
+		console_write_uint(17, y+s, 8, stats[s]->hits);
+		console_setcolor(2); console_write(25, y+s, "\xb3"); console_setcolor(3);
+		console_write_uint(26, y+s, 5, stats[s]->builds);
+		console_setcolor(2); console_write(31, y+s, "\xb3"); console_setcolor(3);
+		console_write_uint(32, y+s, 3, stats[s]->size);
+#		ifdef CHECK_RASTERIZER
+		console_setcolor(2); console_write(35, y+s, "\xb3"); console_setcolor(3);
+		console_write_uint(36, y+s, 4, stats[s]->pixels ? stats[s]->insns / stats[s]->pixels : 0);	// instructions per pixel
+#		endif
+	}
+}
 static void update_console(void) {
 	if (! console_enabled) return;
 	console_setcolor(3);
@@ -140,6 +195,7 @@ static void update_console(void) {
 	console_write_uint(9, 1, 5, shared->frame_count);
 	console_write_uint(29, 1, 5, shared->frame_miss);
 	console_write_uint(9, 2, 5, proj_cache_ratio());
+	console_write_uint(29, 2, 5, id_cache_ratio());
 	console_stat(5, PERF_WAITCMD);
 	console_stat(6, PERF_CMD);
 	console_stat(7, PERF_CLIP);
@@ -150,6 +206,8 @@ static void update_console(void) {
 	console_stat(12, PERF_DISPLAY);
 	console_stat(13, PERF_DIV);
 	console_stat(14, PERF_OTHER);
+	console_stat(15, PERF_JIT);
+	console_jit(17);
 }
 
 static void vertical_interrupt(void) {
@@ -187,6 +245,13 @@ static void reset_clipPlanes(void) {
 	Fix_normalize(ctx.view.clipPlanes[4].normal);
 }
 
+static void reset_scissor(void) {
+	ctx.view.scissorMin[0] = ctx.view.scissorMin[1] = 0;
+	ctx.view.scissorMax[0] = ctx.view.winWidth;
+	ctx.view.scissorMax[1] = ctx.view.winHeight;
+	ctx.view.scissor_rect = 0;
+}
+
 #if 0
 static uint32_t next_power_of_2(uint32_t x) {
 	// TODO: on ARM use CLZ
@@ -213,7 +278,7 @@ static void ctx_code_buf_reset(void)
 	for (unsigned b=0; b<sizeof_array(ctx.location.buffer_loc); b++) {
 		ctx.code.buff_addr[b] = &shared->buffers[ctx.location.buffer_loc[b].address];
 	}
-	ctx.code.out2zb = ctx.location.buffer_loc[gpuZBuffer].address - ctx.location.buffer_loc[gpuOutBuffer].address;
+	ctx.code.out2zb = (ctx.location.buffer_loc[gpuZBuffer].address - ctx.location.buffer_loc[gpuOutBuffer].address) << 2;
 }
 
 static void ctx_code_reset(void)
@@ -224,8 +289,12 @@ static void ctx_code_reset(void)
 
 static void ctx_reset(void) {
 	my_memset(&ctx, 0, sizeof ctx);
+	my_memset(pipelines, 0, sizeof(pipelines));
 	ctx.location.buffer_loc[gpuOutBuffer].width_log = next_log_2(SCREEN_WIDTH+6);
 	ctx.location.buffer_loc[gpuOutBuffer].height = SCREEN_HEIGHT+6;
+	for (unsigned b=0; b<sizeof_array(ctx.location.pix_log); b++) {
+		ctx.location.pix_log[b] = 2;
+	}
 	ctx.view.winPos[0] = GPU_DEFAULT_WINPOS0;
 	ctx.view.winPos[1] = GPU_DEFAULT_WINPOS1;
 	ctx.view.clipMin[0] = GPU_DEFAULT_CLIPMIN0;
@@ -235,6 +304,9 @@ static void ctx_reset(void) {
 	ctx.view.winWidth = ctx.view.clipMax[0] - ctx.view.clipMin[0];
 	ctx.view.winHeight = ctx.view.clipMax[1] - ctx.view.clipMin[1];
 	ctx.view.dproj = GPU_DEFAULT_DPROJ;
+	ctx.location.z_shift = GPU_DEFAULT_ZSHIFT;
+	ctx.query.active = 0;
+	ctx.line.nb_lines = 0;	// generated codes draw single spans unless told otherwise
 	ctx.rendering.mode.named.z_mode = gpu_z_off;
 	ctx.rendering.mode.named.rendering_type = rendering_flat;
 	ctx.rendering.mode.named.use_key = 0;
@@ -246,6 +318,7 @@ static void ctx_reset(void) {
 	ctx.rendering.mode.named.write_z = 1;
 	reset_clipPlanes();
 	ctx.view.nb_clipPlanes = 5;
+	reset_scissor();
 	ctx_code_reset();
 }
 
@@ -256,6 +329,13 @@ static void shared_soft_reset(void) {
 }
 static void shared_reset(void) {
 	shared->cmds_begin = shared->cmds_end = 0;
+	shared->jit_version = JIT_VERSION;
+	for (unsigned k=0; k<sizeof_array(shared->jit_keys); k++) {
+		shared->jit_keys[k] = 0;
+	}
+	for (unsigned f=0; f<sizeof_array(shared->fences); f++) {
+		shared->fences[f] = 0;
+	}
 #ifdef GP2X
 	shared->osd_head[0] = 0;
 	// FIXME: use SCREEN_WIDTH / SCREEN_HEIGHT
@@ -335,9 +415,8 @@ static void reset_prepared_jit(void)
  * Command processing
  */
 
-static void do_setView(void)
+static void set_view(gpuCmdSetView const *setView)
 {
-	gpuCmdSetView const *const setView = (gpuCmdSetView *)get_cmd();
 	ctx.view.dproj = setView->dproj;
 	ctx.view.clipMin[0] = setView->clipMin[0];
 	ctx.view.clipMin[1] = setView->clipMin[1];
@@ -347,8 +426,23 @@ static void do_setView(void)
 	ctx.view.winPos[1] = setView->winPos[1];
 	ctx.view.winWidth = ctx.view.clipMax[0] - ctx.view.clipMin[0];
 	ctx.view.winHeight = ctx.view.clipMax[1] - ctx.view.clipMin[1];
-	next_cmd(sizeof(*setView));
 	reset_clipPlanes();
+	reset_scissor();
+	id_cache_flush();	// cached projections are obsolete
+}
+static bool is_view(gpuCmdSetView const *setView)
+{
+	return
+		ctx.view.dproj == setView->dproj &&
+		ctx.view.clipMin[0] == setView->clipMin[0] && ctx.view.clipMin[1] == setView->clipMin[1] &&
+		ctx.view.clipMax[0] == setView->clipMax[0] && ctx.view.clipMax[1] == setView->clipMax[1] &&
+		ctx.view.winPos[0] == setView->winPos[0] && ctx.view.winPos[1] == setView->winPos[1];
+}
+static void do_setView(void)
+{
+	gpuCmdSetView const *const setView = (gpuCmdSetView *)get_cmd();
+	set_view(setView);
+	next_cmd(sizeof(*setView));
 }
 static void do_setUsrClipPlanes(void)
 {
@@ -359,31 +453,72 @@ static void do_setUsrClipPlanes(void)
 	}
 	next_cmd(sizeof(*setCP));
 }
-static void do_setBuf(void)
+static void do_scissor(void)
 {
-	gpuCmdSetBuf const *const setBuf = (gpuCmdSetBuf *)get_cmd();
-	if (setBuf->type >= GPU_NB_BUFFER_TYPES) {
-		set_error_flag(gpuEPARAM);
-		goto dsb_quit;
+	gpuCmdScissor const *const scissor = (gpuCmdScissor *)get_cmd();
+	reset_scissor();
+	if (scissor->enable) {
+		int32_t const pos[2] = { scissor->pos[0], scissor->pos[1] };
+		int32_t const size[2] = { scissor->width, scissor->height };
+		for (unsigned c=2; c--; ) {
+			if (pos[c] > ctx.view.scissorMin[c]) ctx.view.scissorMin[c] = pos[c];
+			if (size[c] < ctx.view.scissorMax[c] - pos[c]) ctx.view.scissorMax[c] = pos[c] + size[c];
+			if (ctx.view.scissorMax[c] < ctx.view.scissorMin[c]) ctx.view.scissorMax[c] = ctx.view.scissorMin[c];	// nothing will be drawn
+		}
+		ctx.view.scissor_rect = 1;
 	}
-	my_memcpy(&ctx.location.buffer_loc[setBuf->type], &setBuf->loc, sizeof(*ctx.location.buffer_loc));
-	if (ctx.location.buffer_loc[setBuf->type].width_log > 15) {
+	next_cmd(sizeof(*scissor));
+}
+static void do_precompile(void)
+{
+	gpuCmdPrecompile const *const precompile = (gpuCmdPrecompile *)get_cmd();
+	if (precompile->nb_keys > GPU_NB_JIT_KEYS) {
 		set_error_flag(gpuEPARAM);
-		goto dsb_quit;
+		next_cmd(sizeof(*precompile));
+		return;
 	}
-	if (setBuf->type == gpuTxtBuffer) {
-		ctx.location.txt_width_mask = (1U<<setBuf->loc.width_log)-1;
-		ctx.location.txt_height_mask = setBuf->loc.height-1;
-		ctx.location.txt_height_log = next_log_2(setBuf->loc.height);
-		if ((1U<<ctx.location.txt_height_log) != setBuf->loc.height) {
-			set_error_flag(gpuEPARAM);
-			goto dsb_quit;
+	if (precompile->version == JIT_VERSION) {	// otherwise these keys mean nothing to us
+		uint32_t const *const keys = (uint32_t const *)(precompile+1);
+		for (unsigned k=0; k<precompile->nb_keys; k++) {
+			if (! jit_precompile(((uint64_t)keys[2*k+1]<<32) | keys[2*k])) set_error_flag(gpuEPARAM);
 		}
-		reset_prepared_jit();
-	} else if (setBuf->type == gpuOutBuffer) {
+	}
+	next_cmd(sizeof(*precompile) + precompile->nb_keys*2*sizeof(uint32_t));
+}
+static bool buffer_ok(gpuBufferType type, struct buffer_loc const *loc, uint32_t z_shift)
+{
+	return
+		loc->width_log <= 15 &&
+		loc->format <= gpuFmt16 &&
+		(type != gpuZBuffer || z_shift <= 16) &&
+		(type != gpuTxtBuffer || (loc->format == gpuFmt32 && (1U<<next_log_2(loc->height)) == loc->height));
+}
+// Does not reset the code buffers nor the rasterizer
+static void set_buffer(gpuBufferType type, struct buffer_loc const *loc, uint32_t z_shift)
+{
+	my_memcpy(&ctx.location.buffer_loc[type], loc, sizeof(*ctx.location.buffer_loc));
+	ctx.location.pix_log[type] = loc->format == gpuFmt16 ? 1:2;
+	if (type == gpuTxtBuffer) {
+		clear_forget(loc);	// textures are written by the client : pending clears are stale
+		ctx.location.txt_width_mask = (1U<<loc->width_log)-1;
+		ctx.location.txt_height_mask = loc->height-1;
+		ctx.location.txt_height_log = next_log_2(loc->height);
+	} else if (type == gpuOutBuffer) {
 		ctx.location.out_start = location_winPos(gpuOutBuffer, 0, 0);
+	} else {
+		ctx.location.z_shift = z_shift;
+	}
+}
+static void do_setBuf(void)
+{
+	gpuCmdSetBuf const *const setBuf = (gpuCmdSetBuf *)get_cmd();
+	if (setBuf->type >= GPU_NB_BUFFER_TYPES || ! buffer_ok(setBuf->type, &setBuf->loc, setBuf->z_shift)) {
+		set_error_flag(gpuEPARAM);
+		goto dsb_quit;
 	}
+	set_buffer(setBuf->type, &setBuf->loc, setBuf->z_shift);
 	ctx_code_buf_reset();
+	reset_prepared_jit();	// texture size, pixel formats and depth mapping are part of the rendering key
 dsb_quit:
 	next_cmd(sizeof(*setBuf));
 }
@@ -396,7 +531,13 @@ static void do_showBuf(void)
 		set_error_flag(gpuEDLIST);
 		goto dwb_quit;
 	}
-	displist[displist_end] = showBuf->loc;
+	displist[displist_end].loc = showBuf->loc;
+#	ifdef GP2X
+	clear_flush(&showBuf->loc);	// the video controller reads the buffer by itself
+	displist[displist_end].clear.pending = 0;
+#	else
+	clear_snapshot(&showBuf->loc, &displist[displist_end].clear);
+#	endif
 	displist_end = next_displist_end;
 #ifndef GP2X
 //	vertical_interrupt();
@@ -404,15 +545,45 @@ static void do_showBuf(void)
 dwb_quit:
 	next_cmd(sizeof(*showBuf));
 }
+// Pending clears of the rows we are about to draw must be done first
+static void touch_facet(void)
+{
+	int32_t y_min = INT32_MAX, y_max = INT32_MIN;
+	gpuVector const *v = ctx.points.first_vector;
+	do {
+		if (v->c2d[1] < y_min) y_min = v->c2d[1];
+		if (v->c2d[1] > y_max) y_max = v->c2d[1];
+		v = v->next;
+	} while (v != ctx.points.first_vector);
+	clear_touch(y_min>>16, y_max>>16);
+}
+static void touch_line(void)
+{
+	int32_t const y0 = ctx.points.vectors[0].c2d[1], y1 = ctx.points.vectors[1].c2d[1];
+	if (y0 < y1) clear_touch(y0>>16, y1>>16);
+	else clear_touch(y1>>16, y0>>16);
+}
 static void do_point(void)
 {
 	gpuCmdPoint const *const point = (gpuCmdPoint *)get_cmd();
 	ctx.points.vectors[0].cmd = (gpuCmdVector *)(point+1);
 	if (clip_point()) {
+		clear_touch(ctx.points.vectors[0].c2d[1]>>16, ctx.points.vectors[0].c2d[1]>>16);
 		draw_point(point->color);
 	}
 	next_cmd(sizeof(*point) + sizeof(gpuCmdVector));
 }
+static void do_points(void)
+{
+	gpuCmdPoints const *const points = (gpuCmdPoints *)get_cmd();
+	if (points->point_size < 1) {
+		set_error_flag(gpuEPARAM);
+		goto dps_quit;
+	}
+	draw_points((gpuCmdPointVec *)(points+1), points->size, points->point_size);
+dps_quit:
+	next_cmd(sizeof(*points) + points->size*sizeof(gpuCmdPointVec));
+}
 static void do_line(void)
 {
 	gpuCmdLine const *const line = (gpuCmdLine *)get_cmd();
@@ -420,11 +591,38 @@ static void do_line(void)
 	ctx.points.vectors[0].cmd = vec;
 	ctx.points.vectors[1].cmd = vec+1;
 	if (clip_line()) {
+		touch_line();
 		ctx.code.color = line->color;
 		draw_line();
 	}
 	next_cmd(sizeof(*line) + 2*sizeof(*vec));
 }
+static void do_lines(void)
+{
+	gpuCmdLines const *const lines = (gpuCmdLines *)get_cmd();
+	gpuCmdVector const *const vec = (gpuCmdVector *)(lines+1);
+	size_t const to_skip = sizeof(*lines) + lines->size*sizeof(*vec);
+	if (lines->size < 2) {
+		set_error_flag(gpuEPARAM);
+		goto dls_quit;
+	}
+	ctx.code.color = lines->color;
+	unsigned const step = lines->strip ? 1:2;
+	for (unsigned v=0; v+1 < lines->size; v+=step) {
+		// clip_line() works in place, and vectors of a strip are used twice : work on a copy
+		static gpuCmdVector seg[2];
+		my_memcpy(seg, vec+v, sizeof(seg));
+		seg[0].same_as = seg[1].same_as = 0;	// same_as hints do not apply to these copies
+		ctx.points.vectors[0].cmd = seg+0;
+		ctx.points.vectors[1].cmd = seg+1;
+		if (clip_line()) {
+			touch_line();
+			draw_line();
+		}
+	}
+dls_quit:
+	next_cmd(to_skip);
+}
 static void do_facet(void)
 {
 	// Warning: don't skip any vector here (without positionning err_flag) or future same_as hints will be wrong.
@@ -443,7 +641,12 @@ static void do_facet(void)
 	for (unsigned v=0; v<ctx.poly.cmd->size; v++) {
 		ctx.points.vectors[v].cmd = (gpuCmdVector *)(ctx.poly.cmd+1) + v;
 	}
-	if (clip_poly() && cull_poly()) {
+	// Facets which orientation is known are culled before clipping, and only degenerate ones are tested once projected
+	int const facing = cull_poly_3d();
+	if (! facing) {
+		proj_cache_skip();
+	} else if (clip_poly() && (facing > 0 || cull_poly())) {
+		touch_facet();
 		ctx.code.color = ctx.poly.cmd->color;
 		if (ctx.rendering.mode.named.perspective) draw_poly_persp();
 		else draw_poly_nopersp();
@@ -451,38 +654,262 @@ static void do_facet(void)
 df_quit:
 	next_cmd(to_skip);
 }
+static void do_vcache(void)
+{
+	gpuCmdVCache const *const vcache = (gpuCmdVCache *)get_cmd();
+	if (vcache->size_log < 2 || vcache->size_log > 8) {
+		set_error_flag(gpuEPARAM);
+		goto dvc_quit;
+	}
+	id_cache_config(vcache->size_log, vcache->lru);
+dvc_quit:
+	next_cmd(sizeof(*vcache));
+}
+// Skips the command and, if skip is set, the given number of words following it.
+// These must have been written together with the command, so that they are contiguous and all there.
+static void skip_cmd(size_t size, uint32_t skip)
+{
+	if (skip) {
+		unsigned const begin = shared->cmds_begin + size/sizeof(uint32_t);
+		unsigned const end = shared->cmds_end;
+		if (skip >= sizeof_array(shared->cmds) - begin || (end >= begin && end - begin < skip)) {
+			set_error_flag(gpuEPARAM);
+			skip = 0;
+		}
+		if (skip) proj_cache_break();	// the skipped vectors did not enter the cache
+	}
+	next_cmd(size + skip*sizeof(uint32_t));
+}
+static void do_cull_sphere(void)
+{
+	gpuCmdCullSphere const *const cull = (gpuCmdCullSphere *)get_cmd();
+	skip_cmd(sizeof(*cull), cull_sphere(cull->center, cull->radius) ? cull->skip : 0);
+}
+static void do_cull_box(void)
+{
+	gpuCmdCullBox const *const cull = (gpuCmdCullBox *)get_cmd();
+	skip_cmd(sizeof(*cull), cull_box(cull->min, cull->max) ? cull->skip : 0);
+}
+static void do_begin_query(void)
+{
+	gpuCmdBeginQuery const *const query = (gpuCmdBeginQuery *)get_cmd();
+	if (query->slot >= GPU_NB_QUERIES || ctx.query.active) {
+		set_error_flag(gpuEPARAM);
+		goto dbq_quit;
+	}
+	ctx.query.active = 1;
+	ctx.query.slot = query->slot;
+	ctx.query.pixels = 0;
+	shared->queries[query->slot] = GPU_QUERY_PENDING;
+	reset_prepared_jit();	// counting is part of the rendering key
+dbq_quit:
+	next_cmd(sizeof(*query));
+}
+static void do_end_query(void)
+{
+	(void)get_cmd();
+	if (! ctx.query.active) {
+		set_error_flag(gpuEPARAM);
+		goto deq_quit;
+	}
+	ctx.query.active = 0;
+	reset_prepared_jit();
+	shared->queries[ctx.query.slot] = ctx.query.pixels < GPU_QUERY_PENDING ? ctx.query.pixels : GPU_QUERY_PENDING-1;
+deq_quit:
+	next_cmd(sizeof(gpuCmdEndQuery));
+}
+static void do_if_visible(void)
+{
+	gpuCmdIfVisible const *const cond = (gpuCmdIfVisible *)get_cmd();
+	if (cond->slot >= GPU_NB_QUERIES) {
+		set_error_flag(gpuEPARAM);
+		next_cmd(sizeof(*cond));
+		return;
+	}
+	// A pending query (not ended yet) counts as visible
+	skip_cmd(sizeof(*cond), shared->queries[cond->slot] == 0 ? cond->skip : 0);
+}
 static void do_rect(void)
 {
 	int previous_target = perftime_target();
 	perftime_enter(PERF_RECTANGLE, "rectangle");
 	gpuCmdRect const *const rect = (gpuCmdRect *)get_cmd();
 	// TODO: add clipping against winPos ?
-	uint32_t *dst = rect->relative_to_window ?
-		location_winPos(rect->type, rect->pos[0], rect->pos[1]) :
-			location_pos(rect->type, rect->pos[0], rect->pos[1]);
-	for (unsigned h=rect->height; h--; ) {
-		my_memset_words(dst, rect->value, rect->width);
-		dst += 1 << ctx.location.buffer_loc[rect->type].width_log;
+	int32_t x = rect->pos[0], y = rect->pos[1];
+	if (rect->relative_to_window) {
+		x += ctx.view.winPos[0];
+		y += ctx.view.winPos[1];
 	}
+	clear_rect(rect->type, x, y, rect->width, rect->height, rect->value);
 	next_cmd(sizeof(*rect));
 	perftime_enter(previous_target, NULL);
 }
-static void do_mode(void)
+static gpuMode clean_mode(gpuMode mode)
 {
-	gpuCmdMode const *const mode = (gpuCmdMode *)get_cmd();
-	ctx.rendering.mode.flags = mode->mode.flags;
 	// To avoid some tests here and there and reduce the number of flags combinations, clear unused flags
-	if (ctx.rendering.mode.named.rendering_type != rendering_text) {
-		ctx.rendering.mode.named.use_txt_blend = 0;
-		if (ctx.rendering.mode.named.rendering_type == rendering_smooth) {
-			ctx.rendering.mode.named.use_intens = 0;
+	if (mode.named.rendering_type != rendering_text) {
+		mode.named.use_txt_blend = 0;
+		if (mode.named.rendering_type == rendering_smooth) {
+			mode.named.use_intens = 0;
 		}
-	} else if (ctx.rendering.mode.named.use_txt_blend) {
-		ctx.rendering.mode.named.blend_coef = 0;
+	} else if (mode.named.use_txt_blend) {
+		mode.named.blend_coef = 0;
 	}
+	return mode;
+}
+static void do_mode(void)
+{
+	gpuCmdMode const *const mode = (gpuCmdMode *)get_cmd();
+	ctx.rendering.mode = clean_mode(mode->mode);
 	next_cmd(sizeof(*mode));
 	reset_prepared_jit();
 }
+static void do_setPipeline(void)
+{
+	gpuCmdSetPipeline const *const set = (gpuCmdSetPipeline *)get_cmd();
+	if (set->pipeline >= GPU_NB_PIPELINES) {
+		set_error_flag(gpuEPARAM);
+		goto dsp_quit;
+	}
+	for (unsigned b=0; b<GPU_NB_BUFFER_TYPES; b++) {
+		if ((set->use_buf & (1U<<b)) && ! buffer_ok(b, set->loc+b, set->z_shift)) {
+			set_error_flag(gpuEPARAM);
+			goto dsp_quit;
+		}
+	}
+	struct pipeline *const p = pipelines + set->pipeline;
+	my_memcpy(&p->set, set, sizeof(p->set));
+	p->set.mode = clean_mode(set->mode);
+	p->rasterizer = NULL;
+	p->defined = true;
+	if (! p->set.mode.named.perspective) {
+		// generate the code now, with the buffers of the context for those that are not part of the pipeline
+		uint32_t pix_log[GPU_NB_BUFFER_TYPES];
+		for (unsigned b=0; b<GPU_NB_BUFFER_TYPES; b++) {
+			pix_log[b] = p->set.use_buf & (1U<<b) ? (p->set.loc[b].format == gpuFmt16 ? 1:2) : ctx.location.pix_log[b];
+		}
+		bool const own_txt = p->set.use_buf & (1U<<gpuTxtBuffer);
+		(void)jit_precompile(jit_rendering_key(
+			p->set.mode, pix_log,
+			p->set.use_buf & (1U<<gpuZBuffer) ? p->set.z_shift : ctx.location.z_shift,
+			own_txt ? p->set.loc[gpuTxtBuffer].width_log : ctx.location.buffer_loc[gpuTxtBuffer].width_log,
+			own_txt ? next_log_2(p->set.loc[gpuTxtBuffer].height) : ctx.location.txt_height_log));
+	}
+dsp_quit:
+	next_cmd(sizeof(*set));
+}
+static void do_bindPipeline(void)
+{
+	gpuCmdBindPipeline const *const bind = (gpuCmdBindPipeline *)get_cmd();
+	uint32_t const pipeline = bind->pipeline;
+	next_cmd(sizeof(*bind));
+	if (pipeline >= GPU_NB_PIPELINES || ! pipelines[pipeline].defined) {
+		set_error_flag(gpuEPARAM);
+		return;
+	}
+	struct pipeline *const p = pipelines + pipeline;
+	if (p->set.use_view && ! is_view(&p->set.view)) set_view(&p->set.view);	// the out buffer start depends on it
+	for (unsigned b=0; b<GPU_NB_BUFFER_TYPES; b++) {
+		if (p->set.use_buf & (1U<<b)) set_buffer(b, p->set.loc+b, p->set.z_shift);
+	}
+	ctx.rendering.mode = p->set.mode;
+	ctx_code_buf_reset();
+	if (! ctx.rendering.mode.named.perspective) {
+		// the code prepared when last bound is found without a lookup if it's still in the cache
+		if (p->rasterizer) ctx.rendering.rasterizer = p->rasterizer;
+		reset_prepared_jit();
+		p->rasterizer = ctx.rendering.rasterizer;
+	}
+}
+static void do_moveBuf(void)
+{
+	gpuCmdMoveBuf const *const move = (gpuCmdMoveBuf *)get_cmd();
+	uint32_t const src = move->src, dst = move->dst, size = move->size;
+	next_cmd(sizeof(*move));
+	if (
+		size > sizeof_array(shared->buffers) ||
+		src > sizeof_array(shared->buffers) - size ||
+		dst > sizeof_array(shared->buffers) - size ||
+		(src < dst + size && dst < src + size)
+	) {
+		set_error_flag(gpuEPARAM);
+		return;
+	}
+	my_memcpy(shared->buffers+dst, shared->buffers+src, size*sizeof(*shared->buffers));
+	clear_relocate(src, dst);	// pending bands were not copied
+	// then use the copy wherever the GPU still refers to the original
+	bool bound = false;
+	for (unsigned b=0; b<GPU_NB_BUFFER_TYPES; b++) {
+		if (ctx.location.buffer_loc[b].address != src) continue;
+		struct buffer_loc loc = ctx.location.buffer_loc[b];
+		loc.address = dst;
+		set_buffer(b, &loc, ctx.location.z_shift);
+		bound = true;
+	}
+	if (bound) ctx_code_buf_reset();
+	for (unsigned p=0; p<GPU_NB_PIPELINES; p++) {
+		for (unsigned b=0; b<GPU_NB_BUFFER_TYPES; b++) {
+			if ((pipelines[p].set.use_buf & (1U<<b)) && pipelines[p].set.loc[b].address == src) {
+				pipelines[p].set.loc[b].address = dst;
+			}
+		}
+	}
+	for (unsigned d=displist_begin; d!=displist_end; d = d+1 < sizeof_array(displist) ? d+1:0) {
+		if (displist[d].loc.address == src) displist[d].loc.address = dst;
+	}
+}
+static bool loc_in_buffers(struct buffer_loc const *loc, unsigned pix_log)
+{
+	if (loc->width_log > 18 || loc->height > (2*sizeof_array(shared->buffers)) >> loc->width_log) return false;
+	uint32_t const size = ((loc->height << loc->width_log) << pix_log) >> 2;	// in words
+	return size <= sizeof_array(shared->buffers) && loc->address <= sizeof_array(shared->buffers) - size;
+}
+static void do_upload(void)
+{
+	gpuCmdUpload const *const upload = (gpuCmdUpload *)get_cmd();
+	struct buffer_loc const *const src = &upload->src, *const dst = &upload->dst;
+	unsigned const src_pix_log = src->format == gpuFmt16 ? 1:2;
+	uint32_t const src_size = ((src->height << src->width_log) << src_pix_log) >> 2, dst_size = dst->height << dst->width_log;
+	if (
+		src->format > gpuFmt16 || dst->format != gpuFmt32 ||
+		src->width_log != dst->width_log || src->height != dst->height ||
+		! loc_in_buffers(src, src_pix_log) || ! loc_in_buffers(dst, 2) ||
+		(src->address != dst->address && src->address < dst->address + dst_size && dst->address < src->address + src_size)
+	) {
+		set_error_flag(gpuEPARAM);
+		goto du_quit;
+	}
+	// The client wrote the picture in src, and all of dst is about to be written : pending clears are stale
+	clear_forget(src);
+	clear_forget(dst);
+	// backward, so that a picture can be converted in place (a gpuFmt16 pixel is before the word it becomes)
+	uint32_t *const d = shared->buffers + dst->address;
+	if (src->format == gpuFmt16) {
+		uint16_t const *const s = (uint16_t *)(shared->buffers + src->address);
+		for (unsigned c = dst_size; c--; ) {
+			unsigned const v = s[c];
+			d[c] = gpuColorAlpha(((v>>11)<<3) | (v>>13), (((v>>5)&0x3f)<<2) | ((v>>9)&3), ((v&0x1f)<<3) | ((v>>2)&7), 0xff);
+		}
+	} else {
+		uint32_t const *const s = shared->buffers + src->address;
+		for (unsigned c = dst_size; c--; ) {
+			uint32_t const v = s[c];
+			d[c] = gpuColorAlpha((v>>16)&0xff, (v>>8)&0xff, v&0xff, v>>24);
+		}
+	}
+du_quit:
+	next_cmd(sizeof(*upload));
+}
+static void do_fence(void)
+{
+	gpuCmdFence const *const fence = (gpuCmdFence *)get_cmd();
+	if (fence->slot >= GPU_NB_FENCES) {
+		set_error_flag(gpuEPARAM);
+	} else {
+		shared->fences[fence->slot] = fence->value;	// next_cmd() drains the write buffer, pixels first
+	}
+	next_cmd(sizeof(*fence));
+}
 static void do_dbg(void)
 {
 	gpuCmdDbg const *const dbg = (gpuCmdDbg *)get_cmd();
@@ -498,7 +925,12 @@ static void do_reset(void)
 	(void)get_cmd();
 	next_cmd(sizeof(gpuCmdReset));
 	proj_cache_reset();
+	clear_reset();
 	ctx_reset();
+	// generate again the codes we already needed, so that they are ready when we need them again
+	for (unsigned k=0; k<GPU_NB_JIT_KEYS && (shared->jit_keys[2*k] || shared->jit_keys[2*k+1]); k++) {
+		(void)jit_precompile(((uint64_t)shared->jit_keys[2*k+1]<<32) | shared->jit_keys[2*k]);
+	}
 	shared_soft_reset();
 	video_reset();
 	perftime_reset();
@@ -548,6 +980,51 @@ static void fetch_command(void)
 		case gpuMODE:
 			do_mode();
 			break;
+		case gpuVCACHE:
+			do_vcache();
+			break;
+		case gpuCULL_SPHERE:
+			do_cull_sphere();
+			break;
+		case gpuCULL_BOX:
+			do_cull_box();
+			break;
+		case gpuBEGIN_QUERY:
+			do_begin_query();
+			break;
+		case gpuEND_QUERY:
+			do_end_query();
+			break;
+		case gpuIF_VISIBLE:
+			do_if_visible();
+			break;
+		case gpuSCISSOR:
+			do_scissor();
+			break;
+		case gpuPRECOMPILE:
+			do_precompile();
+			break;
+		case gpuSETPIPELINE:
+			do_setPipeline();
+			break;
+		case gpuBIND_PIPELINE:
+			do_bindPipeline();
+			break;
+		case gpuMOVEBUF:
+			do_moveBuf();
+			break;
+		case gpuUPLOAD:
+			do_upload();
+			break;
+		case gpuFENCE:
+			do_fence();
+			break;
+		case gpuLINES:
+			do_lines();
+			break;
+		case gpuPOINTS:
+			do_points();
+			break;
 		case gpuDBG:
 			do_dbg();
 			break;
@@ -579,8 +1056,14 @@ static void run(void)
 }
 
 extern inline void set_error_flag(unsigned err_mask);
-extern inline uint32_t *location_pos(gpuBufferType type, int32_t x, int32_t y);
-extern inline uint32_t *location_winPos(gpuBufferType type, int32_t x, int32_t y);
+extern inline void *location_pos(gpuBufferType type, int32_t x, int32_t y);
+extern inline void *location_winPos(gpuBufferType type, int32_t x, int32_t y);
+extern inline uint16_t color_32to16(uint32_t color, unsigned odd);
+extern inline uint32_t color_16to32(uint16_t pix, unsigned odd);
+extern inline int32_t z_to_depth16(int32_t z);
+extern inline unsigned pixel_is_odd(void const *p);
+extern inline uint32_t pixel_peek(gpuBufferType type, void const *p);
+extern inline void pixel_poke(gpuBufferType type, void *p, uint32_t color);
 
 #ifdef GP2X
 void enable_irqs(void)
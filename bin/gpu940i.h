@@ -41,6 +41,7 @@ enum {
 	PERF_POLY_DRAW,
 	PERF_RECTANGLE,
 	PERF_DIV,
+	PERF_JIT,
 };
 
 typedef struct gpuVector {
@@ -69,6 +70,8 @@ extern struct ctx {
 		gpuPlane clipPlanes[GPU_NB_CLIPPLANES];
 		uint32_t nb_clipPlanes;
 		uint32_t dproj;
+		int32_t scissorMin[2], scissorMax[2];	// pixels of the window that may be drawn (max excluded)
+		uint32_t scissor_rect;	// set if the scissor rectangle is smaller than the window
 	} view;
 	// Buffers
 	struct {
@@ -76,7 +79,9 @@ extern struct ctx {
 		uint32_t txt_width_mask;
 		uint32_t txt_height_mask;
 		uint32_t txt_height_log;
-		uint32_t *out_start;	// address (in words) of the first pixel of the window.
+		uint32_t pix_log[GPU_NB_BUFFER_TYPES];	// log2 of the pixel size, in bytes
+		uint32_t z_shift;	// depth mapping for 16 bits z buffers
+		uint8_t *out_start;	// address of the first pixel of the window.
 	} location;
 	// Current trapeze
 	struct {
@@ -105,6 +110,7 @@ extern struct ctx {
 		int32_t nc_declived;
 		int32_t decliveness;
 		uint32_t scan_dir;
+		uint32_t scissor;	// spans must be scissored to the window (see clip_poly)
 		int32_t nc_dir;
 		uint32_t nc_log;	// used to shift-left dw in line drawing routines.
 		int32_t z_alpha;
@@ -114,27 +120,44 @@ extern struct ctx {
 	// Current line
 	struct {
 		int32_t count;
-		uint32_t *restrict w;
+		uint8_t *restrict w;
 		int32_t dw;
+		int32_t dw_minor;	// for lines : step along the minor axis, in pixels
 		int32_t decliv;
 		int32_t *param;	// points to side[left].param
 		int32_t dparam[GPU_NB_PARAMS];
+		// Trapeze stepped by the generated code (see draw_trapeze_jit)
+		int32_t nb_lines;	// scanlines left to draw, or <= 0 to draw only the current span
+		int32_t c[2], dc[2];	// left and right sides, 16.16
+		uint8_t *row;	// first pixel of the current scanline
+		int32_t row_dw;	// in bytes
+		int32_t left_param[GPU_NB_PARAMS];	// 16.16
+		int32_t param_alpha[GPU_NB_PARAMS];	// 16.16
 	} line;
+	// Occlusion query
+	struct {
+		uint32_t active;
+		uint32_t slot;
+		uint32_t pixels;	// count of pixels that passed the z test (incremented by generated code also)
+	} query;
 	// generated code
 	struct {
 		uint32_t *buff_addr[GPU_NB_BUFFER_TYPES];	// address of the buffers
-		int32_t out2zb;	// in words
+		int32_t out2zb;	// in bytes
 		uint32_t color;	// extracted from facet cmd for easier access
 		uint32_t sp_save;
-#		define NB_CODE_CACHE 5
+		// Generated codes load the above variables pc relative, so the arena must stay within 4Kb of them
+#		define CODE_ARENA_SIZE 928	// in words
+#		define MAX_CODE_SIZE 147	// biggest code we may generate, in words
+		uint32_t arena[CODE_ARENA_SIZE];
+#		define NB_CODE_CACHE 24
 		struct jit_cache {
-			// TODO: make the buf smaller, but allow a code to span severall bufs
-#			define MAX_CODE_SIZE 102
-			uint32_t buf[MAX_CODE_SIZE];
-			uint32_t use_count;
-			uint64_t rendering_key;
+			uint32_t *buf;	// within arena
+			uint32_t size;	// in words
+			uint32_t last_use;	// for LRU replacement
+			uint64_t rendering_key;	// 0 if the entry is unused
+			struct jit_stat *stat;
 		} caches[NB_CODE_CACHE];
-		// cache handling goes here
 	} code;
 } ctx;
 
@@ -144,6 +167,7 @@ extern struct ctx {
 #include "line.h"
 #include "clip.h"
 #include "text.h"
+#include "clear.h"
 #include "mylib.h"
 #include "raster.h"
 #include "codegen.h"
@@ -151,18 +175,52 @@ extern struct ctx {
 static inline void set_error_flag(unsigned err_mask) {
 	shared->error_flags |= err_mask;	// TODO : use a bit atomic set instruction
 }
-static inline uint32_t *location_pos(gpuBufferType type, int32_t x, int32_t y) {
-	return &shared->buffers[
-		ctx.location.buffer_loc[type].address +
-		(y << ctx.location.buffer_loc[type].width_log) + x
-	];
+static inline void *location_pos(gpuBufferType type, int32_t x, int32_t y) {
+	return (uint8_t *)&shared->buffers[ctx.location.buffer_loc[type].address] + (
+		((y << ctx.location.buffer_loc[type].width_log) + x) << ctx.location.pix_log[type]
+	);
+}
+static inline void *location_winPos(gpuBufferType type, int32_t x, int32_t y) {
+	return location_pos(type, x + ctx.view.winPos[0], y + ctx.view.winPos[1]);
+}
+// Conversions between 32 bits colors and 16 bits pixels. On GP2X, a pair of 16 bits pixels is a
+// YUYV macropixel : even pixels store U and odd pixels store V along with their Y.
+static inline uint16_t color_32to16(uint32_t color, unsigned odd) {
+#ifdef GP2X
+	if (odd) return ((color>>16)&0xff00) | (color&0xff);
+	return color & 0xffff;
+#else
+	(void)odd;
+	return ((color>>8)&0xf800) | ((color>>5)&0x07e0) | ((color>>3)&0x001f);
+#endif
+}
+static inline uint32_t color_16to32(uint16_t pix, unsigned odd) {
+#ifdef GP2X
+	if (odd) return ((pix&0xff00)<<16) | (pix&0xff);
+	return pix;
+#else
+	(void)odd;
+	uint32_t const r = (pix>>11)&0x1f, g = (pix>>5)&0x3f, b = pix&0x1f;
+	return (((r<<3)|(r>>2))<<16) | (((g<<2)|(g>>4))<<8) | ((b<<3)|(b>>2));
+#endif
+}
+// Depth values stored in 16 bits z buffers
+static inline int32_t z_to_depth16(int32_t z) {
+	int32_t const d = z >> ctx.location.z_shift;
+	if (d < 0) return 0;
+	if (d > 0xffff) return 0xffff;
+	return d;
+}
+static inline unsigned pixel_is_odd(void const *p) {
+	return ((uintptr_t)p >> 1) & 1;
+}
+static inline uint32_t pixel_peek(gpuBufferType type, void const *p) {
+	if (ctx.location.pix_log[type] == 1) return color_16to32(*(uint16_t const *)p, pixel_is_odd(p));
+	return *(uint32_t const *)p;
 }
-static inline uint32_t *location_winPos(gpuBufferType type, int32_t x, int32_t y) {
-	return &shared->buffers[
-		ctx.location.buffer_loc[type].address +
-		((y + ctx.view.winPos[1])<<ctx.location.buffer_loc[type].width_log) +
-		x + ctx.view.winPos[0]
-	];
+static inline void pixel_poke(gpuBufferType type, void *p, uint32_t color) {
+	if (ctx.location.pix_log[type] == 1) *(uint16_t *)p = color_32to16(color, pixel_is_odd(p));
+	else *(uint32_t *)p = color;
 }
 
 #endif
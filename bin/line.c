@@ -17,87 +17,108 @@
  */
 #include "gpu940i.h"
 
-/*
- * Data Definitions
- */
-
-#define SWAP(type,a,b) do { \
-	type dummy = a; \
-	a = b; \
-	b = dummy; \
-} while(0)
-
 /*
  * Private Functions
  */
 
-static void draw_scanline(void)
+// Tells which params the rasterizer will use, so that we do not interpolate the others
+static uint32_t used_params(void)
 {
-	int left_vec = 0;
-	int32_t c_start = ctx.points.vectors[0].c2d[ctx.poly.scan_dir] >> 16;
-	int32_t c_stop = ctx.points.vectors[1].c2d[ctx.poly.scan_dir] >> 16;
-	if (c_start > c_stop) {
-		left_vec = 1;
-		SWAP(int32_t, c_start, c_stop);
-	}
-	ctx.line.count = c_stop - c_start;
-	ctx.line.decliv = 0;
-	int32_t const nc_start = ctx.points.vectors[left_vec].c2d[!ctx.poly.scan_dir] >> 16;
-	if (ctx.poly.scan_dir == 0) {
-		ctx.line.w = ctx.location.out_start + c_start + (nc_start<<ctx.location.buffer_loc[gpuOutBuffer].width_log);
-	} else {
-		ctx.line.w = ctx.location.out_start + nc_start + (c_start<<ctx.location.buffer_loc[gpuOutBuffer].width_log);
+	uint32_t used = 0;
+	if (ctx.rendering.mode.named.z_mode != gpu_z_off || ctx.rendering.mode.named.write_z) used |= 1U<<0;
+	switch ((gpuRenderingType)ctx.rendering.mode.named.rendering_type) {
+		case rendering_flat:
+			break;
+		case rendering_text:
+			used |= (1U<<1)|(1U<<2);
+			break;
+		case rendering_smooth:
+			used |= (1U<<1)|(1U<<2)|(1U<<3);
+			break;
 	}
-	ctx.line.param = ctx.points.vectors[left_vec].cmd->u.geom.param;
-	if (ctx.line.count) {
-		int32_t const inv_dc = Fix_uinv(ctx.line.count<<16);
-		for (unsigned p=GPU_NB_PARAMS; p--; ) {
-			ctx.line.dparam[p] = Fix_mul(ctx.points.vectors[!left_vec].cmd->u.geom.param[p] - ctx.line.param[p], inv_dc);
-		}
-	}
-	unsigned const previous_target = perftime_target();
-	perftime_enter(PERF_POLY_DRAW, "raster");
-#ifdef GP2X
-	jit_exec();
-#else
-	raster_gen();
-#endif
-	perftime_enter(previous_target, NULL);
+	if (ctx.rendering.mode.named.use_intens) used |= 1U<<3;
+	return used;
 }
 
 /*
  * Public Function
  */
 
+// Lines are drawn by raster_line(), a DDA that do not need the JIT, so that we do not have to prepare
+// a rasterizer for each line (nor to spoil the one prepared for non perspective facets).
 void draw_line(void)
 {
 	unsigned previous_target = perftime_target();
 	perftime_enter(PERF_POLY, "poly");
-	// compute 'decliveness' related paramters in a way similar to poly, so that we can use the JIT
-	ctx.poly.decliveness = 0;
-	ctx.poly.scan_dir = 0;
-	ctx.line.dw = 1;
-	ctx.poly.nc_log = ctx.location.buffer_loc[gpuOutBuffer].width_log;
-	int32_t m[2];	// 16.16
-	m[0] = ctx.points.vectors[1].c2d[0] - ctx.points.vectors[0].c2d[0];
-	m[1] = ctx.points.vectors[1].c2d[1] - ctx.points.vectors[0].c2d[1];
-	if (Fix_abs(m[0]) < Fix_abs(m[1])) {
-		ctx.poly.scan_dir = 1;
-		ctx.poly.nc_log = 0;
-		SWAP(int32_t, m[0], m[1]);
-		ctx.line.dw <<= ctx.location.buffer_loc[gpuOutBuffer].width_log;
-	}	
-	if (m[0]) ctx.poly.decliveness = (((int64_t)m[1])<<16)/m[0];
-	// To fake the rasterizer, we must make it think we are in perspective mode.
-	int old_persp = ctx.rendering.mode.named.perspective;
-	ctx.rendering.mode.named.perspective = 1;
-	// Now that nc_log is known, prepare the rasterizer
-#	if defined(GP2X) || defined(TEST_RASTERIZER)
-	ctx.rendering.rasterizer = jit_prepare_rasterizer();
-#	endif
-	draw_scanline();
-	ctx.rendering.mode.named.perspective = old_persp;
+	int32_t const *const c0 = ctx.points.vectors[0].c2d;
+	int32_t const *const c1 = ctx.points.vectors[1].c2d;
+	int32_t d[2];	// 16.16
+	d[0] = c1[0] - c0[0];
+	d[1] = c1[1] - c0[1];
+	unsigned const major = Fix_abs(d[0]) < Fix_abs(d[1]);
+	unsigned const minor = ! major;
+	int32_t const dir[2] = { d[0] < 0 ? -1 : 1, d[1] < 0 ? -1 : 1 };
+	int32_t const count = Fix_abs((c1[major]>>16) - (c0[major]>>16));
+	int32_t slope = 0;	// minor move per major pixel, 16.16
+	if (d[major]) slope = (((int64_t)Fix_abs(d[minor]))<<16)/Fix_abs(d[major]);
+	// Where the line crosses the middle of its first pixel along the major axis, and how far this is
+	// within the pixel along the minor step. This may be the pixel next to c0 : the scissor below keeps
+	// it within the window.
+	int32_t const major0 = c0[major]>>16;
+	int32_t const from_mid = (major0<<16) + (1<<15) - c0[major];
+	int32_t const mid = c0[minor] + ((from_mid * (int64_t)(dir[major]*dir[minor]) * slope) >> 16);
+	int32_t const minor0 = mid >> 16;
+	int32_t const err = dir[minor] > 0 ? (mid & 0xffff) : 0xffff - (mid & 0xffff);
+	// Clip the steps to the scissor rectangle (which is the window unless told otherwise) once for all :
+	// after k steps, the pixel is major0 + dir*k along the major axis, and minor0 + dir*((err + k*slope)>>16)
+	// along the minor one.
+	int32_t const *const s_min = ctx.view.scissorMin;
+	int32_t const *const s_max = ctx.view.scissorMax;
+	int64_t first = 0, last = count;
+	int64_t const major_lo = dir[major] > 0 ? s_min[major] - major0 : major0 - (s_max[major]-1);
+	int64_t const major_hi = dir[major] > 0 ? s_max[major]-1 - major0 : major0 - s_min[major];
+	if (major_lo > first) first = major_lo;
+	if (major_hi < last) last = major_hi;
+	int64_t const minor_lo = dir[minor] > 0 ? s_min[minor] - minor0 : minor0 - (s_max[minor]-1);
+	int64_t const minor_hi = dir[minor] > 0 ? s_max[minor]-1 - minor0 : minor0 - s_min[minor];
+	if (minor_hi < 0 || minor_hi < minor_lo) goto dl_quit;
+	if (slope) {
+		if (minor_lo > 0) {
+			int64_t const k = ((minor_lo<<16) - err + slope - 1) / slope;
+			if (k > first) first = k;
+		}
+		int64_t const k = (((minor_hi+1)<<16) - err - 1) / slope;
+		if (k < last) last = k;
+	} else if (minor_lo > 0) {
+		goto dl_quit;
+	}
+	if (last < first) goto dl_quit;
+	// Then start the DDA at the first step within the scissor
+	unsigned const width_log = ctx.location.buffer_loc[gpuOutBuffer].width_log;
+	int32_t const step[2] = { 1, 1<<width_log };	// in pixels
+	int32_t const err_first = err + first*slope;
+	int32_t pix[2];
+	pix[major] = major0 + dir[major]*first;
+	pix[minor] = minor0 + dir[minor]*(err_first>>16);
+	ctx.line.count = last - first;
+	ctx.line.dw = dir[major] * step[major];
+	ctx.line.dw_minor = dir[minor] * step[minor];
+	ctx.line.decliv = err_first & 0xffff;
+	ctx.poly.decliveness = slope;
+	ctx.line.w = ctx.location.out_start + ((pix[0] + (pix[1]<<width_log)) << ctx.location.pix_log[gpuOutBuffer]);
+	ctx.line.param = ctx.points.vectors[0].cmd->u.geom.param;
+	uint32_t const used = used_params();
+	if (count && used) {
+		int32_t const inv_dc = Fix_uinv(count<<16);
+		for (unsigned p=GPU_NB_PARAMS; p--; ) {
+			ctx.line.dparam[p] = 0;
+			if (! (used & (1U<<p))) continue;
+			ctx.line.dparam[p] = Fix_mul(ctx.points.vectors[1].cmd->u.geom.param[p] - ctx.line.param[p], inv_dc);
+		}
+		if (first) scissor_params(first);
+	}
+	perftime_enter(PERF_POLY_DRAW, "raster");
+	raster_line();
+dl_quit:
 	perftime_enter(previous_target, NULL);
 }
-	
-
@@ -17,6 +17,35 @@
  */
 #include "gpu940i.h"
 
+/*
+ * Data Definitions
+ */
+
+#define POINTS_BATCH 64	// points are projected and rejected by batches of this size before being drawn
+
+/*
+ * Private Functions
+ */
+
+static bool in_scissor(int32_t x, int32_t y)
+{
+	return
+		x >= ctx.view.scissorMin[0] && x < ctx.view.scissorMax[0] &&
+		y >= ctx.view.scissorMin[1] && y < ctx.view.scissorMax[1];
+}
+
+static void draw_square(int32_t x, int32_t y, int32_t z, unsigned point_size, uint32_t color)
+{
+	// (x,y) is the center of the square ; clip it to the scissor rectangle (the window by default)
+	int32_t x_start = x - (int32_t)(point_size>>1), x_stop = x_start + point_size;
+	int32_t y_start = y - (int32_t)(point_size>>1), y_stop = y_start + point_size;
+	if (x_start < ctx.view.scissorMin[0]) x_start = ctx.view.scissorMin[0];
+	if (y_start < ctx.view.scissorMin[1]) y_start = ctx.view.scissorMin[1];
+	if (x_stop > ctx.view.scissorMax[0]) x_stop = ctx.view.scissorMax[0];
+	if (y_stop > ctx.view.scissorMax[1]) y_stop = ctx.view.scissorMax[1];
+	raster_square(x_start, y_start, x_stop, y_stop, z, color);
+}
+
 /*
  * Public Function
  */
@@ -25,7 +54,39 @@ void draw_point(uint32_t color)
 {
 	int32_t const x = ctx.points.vectors[0].c2d[0] >> 16;
 	int32_t const y = ctx.points.vectors[0].c2d[1] >> 16;
-	uint32_t *w = ctx.location.out_start + x + (y << ctx.location.buffer_loc[gpuOutBuffer].width_log);
-	*w = color;
+	if (! in_scissor(x, y)) return;
+	raster_square(x, y, x+1, y+1, ctx.points.vectors[0].cmd->u.geom.param[0], color);
 }
 
+
+void draw_points(gpuCmdPointVec const *vec, unsigned size, unsigned point_size)
+{
+	static int32_t c2d[POINTS_BATCH][2];
+	static unsigned idx[POINTS_BATCH];
+	while (size) {
+		unsigned const nb = size < POINTS_BATCH ? size : POINTS_BATCH;
+		unsigned const nb_in = clip_points(vec, nb, c2d, idx);
+		if (nb_in) {
+			int32_t y_min = c2d[0][1], y_max = c2d[0][1];
+			for (unsigned i=1; i<nb_in; i++) {
+				if (c2d[i][1] < y_min) y_min = c2d[i][1];
+				if (c2d[i][1] > y_max) y_max = c2d[i][1];
+			}
+			clear_touch((y_min>>16) - (int32_t)(point_size>>1), (y_max>>16) + (int32_t)(point_size>>1));
+		}
+		if (point_size == 1) {
+			for (unsigned i=0; i<nb_in; i++) {
+				int32_t const x = c2d[i][0] >> 16;
+				int32_t const y = c2d[i][1] >> 16;
+				if (ctx.view.scissor_rect && !in_scissor(x, y)) continue;
+				raster_square(x, y, x+1, y+1, vec[idx[i]].c3d[2], vec[idx[i]].color);
+			}
+		} else {
+			for (unsigned i=0; i<nb_in; i++) {
+				draw_square(c2d[i][0] >> 16, c2d[i][1] >> 16, vec[idx[i]].c3d[2], point_size, vec[idx[i]].color);
+			}
+		}
+		vec += nb;
+		size -= nb;
+	}
+}
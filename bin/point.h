@@ -20,5 +20,6 @@
 #include "../config.h"
 
 void draw_point(uint32_t color);
+void draw_points(gpuCmdPointVec const *vec, unsigned size, unsigned point_size);
 
 #endif
@@ -33,25 +33,27 @@
 
 // buffers are so lower coords have lower addresses.
 static void draw_scanline(void) {
-	int32_t const c_start = ctx.trap.side[ctx.trap.left_side].c >> 16;
+	int32_t c_start = ctx.trap.side[ctx.trap.left_side].c >> 16;
 	ctx.line.count = (ctx.trap.side[!ctx.trap.left_side].c >> 16) - c_start;
 	if (unlikely(ctx.line.count <= 0)) return;	// may happen on some pathological cases
-	ctx.line.w = ctx.location.out_start + c_start + ((ctx.poly.nc_declived>>16)<<ctx.location.buffer_loc[gpuOutBuffer].width_log);
-	ctx.line.decliv = ctx.poly.decliveness * c_start;	// 16.16
-	if (ctx.poly.scan_dir != 0) {
-		ctx.line.w = ctx.location.out_start + (ctx.poly.nc_declived>>16) + (c_start<<ctx.location.buffer_loc[gpuOutBuffer].width_log);
-	}
 	int32_t const inv_dc = Fix_uinv(ctx.line.count<<16);
+	ctx.line.param = ctx.trap.side[ctx.trap.left_side].param;
 	for (unsigned p=sizeof_array(ctx.line.dparam); p--; ) {
 		ctx.line.dparam[p] = Fix_mul(ctx.trap.side[!ctx.trap.left_side].param[p] - ctx.line.param[p], inv_dc);
 	}
+	if (unlikely(ctx.poly.scissor)) {
+		int32_t const skip = scissor_span(&c_start);
+		if (skip < 0) return;
+		if (skip) scissor_params(skip);
+	}
+	ctx.line.w = ctx.location.out_start + ((c_start + ((ctx.poly.nc_declived>>16)<<ctx.location.buffer_loc[gpuOutBuffer].width_log)) << ctx.location.pix_log[gpuOutBuffer]);
+	ctx.line.decliv = ctx.poly.decliveness * c_start;	// 16.16
+	if (ctx.poly.scan_dir != 0) {
+		ctx.line.w = ctx.location.out_start + (((ctx.poly.nc_declived>>16) + (c_start<<ctx.location.buffer_loc[gpuOutBuffer].width_log)) << ctx.location.pix_log[gpuOutBuffer]);
+	}
 	unsigned const previous_target = perftime_target();
 	perftime_enter(PERF_POLY_DRAW, "raster");
-#ifdef GP2X
 	jit_exec();
-#else
-	raster_gen();
-#endif
 	perftime_enter(previous_target, NULL);
 }
 
@@ -34,23 +34,28 @@
 // buffers are so lower coords have lower addresses.
 static void draw_scanline(void)
 {
-	int32_t const c_start = ctx.trap.side[ctx.trap.left_side].c >> 16;
+	int32_t c_start = ctx.trap.side[ctx.trap.left_side].c >> 16;
 	ctx.line.count = (ctx.trap.side[!ctx.trap.left_side].c >> 16) - c_start;
 	if (unlikely(ctx.line.count <= 0)) return;	// may happen on some pathological cases ?
-	ctx.line.w = ctx.location.out_start + c_start + ((ctx.poly.nc_declived>>16)<<ctx.location.buffer_loc[gpuOutBuffer].width_log);
+	int32_t const full_count = ctx.line.count;
+	int32_t skip = 0;
+	if (unlikely(ctx.poly.scissor)) {
+		ctx.line.param = ctx.trap.side[ctx.trap.left_side].param;
+		skip = scissor_span(&c_start);
+		if (skip < 0) return;
+	}
 	if (unlikely(! ctx.trap.is_triangle)) {
-		int32_t const inv_dc = Fix_uinv(ctx.line.count<<16);
+		int32_t const inv_dc = Fix_uinv(full_count<<16);	// params change along the whole span
 		for (unsigned p=sizeof_array(ctx.line.dparam); p--; ) {
 			ctx.line.dparam[p] = Fix_mul(ctx.trap.side[!ctx.trap.left_side].param[p] - ctx.line.param[p], inv_dc);
 		}
 	}
+	if (skip) scissor_params(skip);
+	ctx.line.w = ctx.location.out_start + ((c_start + ((ctx.poly.nc_declived>>16)<<ctx.location.buffer_loc[gpuOutBuffer].width_log)) << ctx.location.pix_log[gpuOutBuffer]);
+	jit_count_spans(ctx.line.count + 1, 1);
 	unsigned const previous_target = perftime_target();
 	perftime_enter(PERF_POLY_DRAW, "raster");
-#ifdef GP2X
 	jit_exec();
-#else
-	raster_gen();
-#endif
 	perftime_enter(previous_target, NULL);
 }
 
@@ -89,6 +94,49 @@ static void draw_trapeze_int(void)
 	draw_scanline();	// will do another DIV
 }
 
+// Draw nb_lines integral scanlines with a single call to the generated code, which steps the
+// sides and params itself. Does nothing if the generated code cannot be used for this trapeze.
+static void draw_trapeze_jit(int32_t nb_lines)
+{
+#	if defined(GP2X) || defined(CHECK_RASTERIZER)
+	// dparam must be constant along the trapeze, and spans must not be scissored
+	if (! ctx.rendering.rasterizer || ! ctx.trap.is_triangle || ctx.poly.scissor || nb_lines <= 0) return;
+	unsigned const left = ctx.trap.left_side;
+	ctx.line.c[0] = ctx.trap.side[left].c;
+	ctx.line.dc[0] = ctx.trap.side[left].dc;
+	ctx.line.c[1] = ctx.trap.side[!left].c;
+	ctx.line.dc[1] = ctx.trap.side[!left].dc;
+	for (unsigned p=sizeof_array(ctx.line.dparam); p--; ) {
+		ctx.line.left_param[p] = ctx.trap.side[left].param[p];
+		ctx.line.param_alpha[p] = ctx.trap.side[left].param_alpha[p];
+	}
+	ctx.line.param = ctx.line.left_param;
+	unsigned const width_log = ctx.location.buffer_loc[gpuOutBuffer].width_log;
+	ctx.line.row = ctx.location.out_start + (((ctx.poly.nc_declived>>16)<<width_log) << ctx.location.pix_log[gpuOutBuffer]);
+	ctx.line.row_dw = 1 << (width_log + ctx.location.pix_log[gpuOutBuffer]);
+	ctx.line.nb_lines = nb_lines;
+	int32_t const first_width = ctx.line.c[1] - ctx.line.c[0];
+	unsigned const previous_target = perftime_target();
+	perftime_enter(PERF_POLY_DRAW, "raster");
+	jit_exec();	// leaves nb_lines to 0
+	perftime_enter(previous_target, NULL);
+	// now advance the sides as draw_trapeze_int() would have done
+	ctx.line.param = ctx.trap.side[left].param;
+	for (unsigned side=2; side--; ) {
+		ctx.trap.side[side].c += nb_lines * ctx.trap.side[side].dc;
+		for (unsigned p=sizeof_array(ctx.line.dparam); p--; ) {
+			ctx.trap.side[side].param[p] += nb_lines * ctx.trap.side[side].param_alpha[p];
+		}
+	}
+	ctx.poly.nc_declived += nb_lines << 16;
+	// count them as spans of the mean width
+	int32_t const last_width = ctx.trap.side[!left].c - ctx.trap.side[left].c;
+	jit_count_spans((first_width + last_width) >> 17, nb_lines);
+#	else
+	(void)nb_lines;
+#	endif
+}
+
 static void draw_trapeze(void)
 {
 	// we have ctx.trap.side[], nc_declived, all params.
@@ -148,7 +196,8 @@ static void draw_trapeze(void)
 		last_nc_declived = ctx.trap.side[1].end_v->c2d[1];
 	}
 	int32_t last_nc_declived_i = last_nc_declived & 0xffff0000;
-	while (ctx.poly.nc_declived != last_nc_declived_i) {
+	draw_trapeze_jit((last_nc_declived_i - ctx.poly.nc_declived) >> 16);
+	while (ctx.poly.nc_declived != last_nc_declived_i) {	// what the generated code did not draw
 		draw_trapeze_int();
 		ctx.poly.nc_declived += 0x10000;
 	}
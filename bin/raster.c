@@ -48,6 +48,114 @@ static bool zpass(int32_t z, gpuZMode z_mode, int32_t zb)
 	return false;
 }
 
+static void *zb_address(uint8_t *w)
+{
+	if (likely(ctx.location.pix_log[gpuZBuffer] == ctx.location.pix_log[gpuOutBuffer])) {
+		return w + ctx.code.out2zb;
+	}
+	// out and z buffers have different pixel sizes : go through the pixel index
+	uint32_t const pix = (w - (uint8_t *)ctx.code.buff_addr[gpuOutBuffer]) >> ctx.location.pix_log[gpuOutBuffer];
+	return (uint8_t *)ctx.code.buff_addr[gpuZBuffer] + (pix << ctx.location.pix_log[gpuZBuffer]);
+}
+
+static int32_t depth_value(int32_t z)
+{
+	if (ctx.location.pix_log[gpuZBuffer] == 1) return z_to_depth16(z);
+	return z;
+}
+
+static int32_t zb_peek(void const *zb)
+{
+	if (ctx.location.pix_log[gpuZBuffer] == 1) return *(uint16_t const *)zb;
+	return *(int32_t const *)zb;
+}
+
+static void zb_poke(void *zb, int32_t depth)
+{
+	if (ctx.location.pix_log[gpuZBuffer] == 1) *(uint16_t *)zb = depth;
+	else *(int32_t *)zb = depth;
+}
+
+// Renders one pixel at address w, with the given params. The rendering mode is read once by the
+// caller, so that its tests can be hoisted out of the pixel loop.
+static inline void raster_pixel(uint8_t *w, int32_t const *param, gpuMode const mode)
+{
+	assert(w >= (uint8_t *)shared->buffers);
+	// ZBuffer
+	if (mode.named.z_mode != gpu_z_off) {
+		int32_t const zb = zb_peek(zb_address(w));
+		if (! zpass(depth_value(param[0]), mode.named.z_mode, zb)) return;
+	}
+	if (ctx.query.active) ctx.query.pixels ++;
+	// Peek color
+	uint32_t color;
+	switch ((gpuRenderingType)mode.named.rendering_type) {
+		case rendering_flat:
+			color = ctx.code.color;
+			break;
+		case rendering_text:
+			color = texture_color(&ctx.location.buffer_loc[gpuTxtBuffer], param[1], param[2]);
+			if (mode.named.use_key) {
+				if (color == ctx.code.color) return;
+			}
+			break;
+		case rendering_smooth:
+			color =
+#			ifdef GP2X
+				((param[3]&0xFF00)<<16)|((param[1]&0xFF00)<<8)|(param[2]&0xFF00)|((param[1]&0xFF00)>>8);
+#			else
+				((param[1]&0xFF00)<<8)|(param[2]&0xFF00)|((param[3]&0xFF00)>>8);
+#			endif
+			break;
+		default:
+			color = 0;	// please GCC don't warn about color
+			assert(0);
+	}
+	// Intens
+	if (mode.named.use_intens) {
+#		ifdef GP2X	// gp2x uses YUV
+		int y = color&0xff;
+		y += (param[3]>>22);
+		SAT8(y);
+		color = (color&0xFFFFFF00) | y;
+#		else
+		int r = ((color>>16)&255)+(param[3]>>16);
+		int g = ((color>>8)&255)+(param[3]>>16);
+		int b = (color&255)+(param[3]>>16);
+		SAT8(r);
+		SAT8(g);
+		SAT8(b);
+		color = (color & 0xFF000000) | (r<<16)|(g<<8)|b;
+#		endif
+	}
+	// Blend
+	unsigned blend = mode.named.blend_coef;
+	if (mode.named.use_txt_blend) {	// color holds blend coef in bits 3,4,5 of unused byte
+		blend = (color >> (
+#		ifdef GP2X
+			16
+#		else
+			24
+#		endif
+			+ 3)) & 0x3;
+	}
+	if (blend) {
+		uint32_t p = pixel_peek(gpuOutBuffer, w);
+		uint64_t p_alpha = p & 0xFCFCFCFFU;
+		p_alpha = ((uint64_t)p_alpha * blend) >> 2;
+		uint64_t c_alpha = color & 0xFCFCFCFFU;
+		c_alpha = ((uint64_t)c_alpha * (4-blend)) >> 2;
+		color = (uint32_t)p_alpha + (uint32_t)c_alpha;	// actually we need 32bits + carry
+	}
+	// Poke
+	if (mode.named.write_out) {
+		pixel_poke(gpuOutBuffer, w, color);
+	}
+	if (mode.named.write_z) {
+		zb_poke(zb_address(w), depth_value(param[0]));
+	}
+}
+
 /*
  * Public Functions
  */
@@ -55,7 +163,9 @@ static bool zpass(int32_t z, gpuZMode z_mode, int32_t zb)
 void raster_gen(void)
 {
 	// 'Registers'
-	uint32_t *restrict w = ctx.line.w;
+	uint8_t *restrict w = ctx.line.w;
+	unsigned const out_log = ctx.location.pix_log[gpuOutBuffer];
+	gpuMode const mode = ctx.rendering.mode;
 	int32_t decliv = ctx.line.decliv;
 	int32_t param[GPU_NB_PARAMS];	// (u,v,i)|(r,g,b),z;
 	for (unsigned i=sizeof_array(param); i--; ) {
@@ -63,96 +173,70 @@ void raster_gen(void)
 	}
 	int count = ctx.line.count;
 	do {
-		uint32_t *w_;
-		if (ctx.rendering.mode.named.perspective) {
-			w_ = w + ((decliv>>16)<<ctx.poly.nc_log);	
+		if (mode.named.perspective) {
+			raster_pixel(w + (((decliv>>16)<<ctx.poly.nc_log)<<out_log), param, mode);
 		} else {
-			w_ = w;
-		}
-		assert(w_ >= shared->buffers);
-		// ZBuffer
-		if (ctx.rendering.mode.named.z_mode != gpu_z_off) {
-			int32_t const zb = *(w_ + ctx.code.out2zb);
-			if (! zpass(param[0], ctx.rendering.mode.named.z_mode, zb)) goto next_pixel;
-		}
-		// Peek color
-		uint32_t color;
-		switch ((gpuRenderingType)ctx.rendering.mode.named.rendering_type) {
-			case rendering_flat:
-				color = ctx.code.color;
-				break;
-			case rendering_text:
-				color = texture_color(&ctx.location.buffer_loc[gpuTxtBuffer], param[1], param[2]);
-				if (ctx.rendering.mode.named.use_key) {
-					if (color == ctx.code.color) goto next_pixel;
-				}
-				break;
-			case rendering_smooth:
-				color =
-#				ifdef GP2X
-					((param[3]&0xFF00)<<16)|((param[1]&0xFF00)<<8)|(param[2]&0xFF00)|((param[1]&0xFF00)>>8);
-#				else
-					((param[1]&0xFF00)<<8)|(param[2]&0xFF00)|((param[3]&0xFF00)>>8);
-#				endif
-				break;
-			default:
-				color = 0;	// please GCC don't warn about color
-				assert(0);
-		}
-		// Intens
-		if (ctx.rendering.mode.named.use_intens) {
-#		ifdef GP2X	// gp2x uses YUV
-			int y = color&0xff;
-			y += (param[3]>>22);
-			SAT8(y);
-			color = (color&0xFFFFFF00) | y;
-#		else
-			int r = ((color>>16)&255)+(param[3]>>16);
-			int g = ((color>>8)&255)+(param[3]>>16);
-			int b = (color&255)+(param[3]>>16);
-			SAT8(r);
-			SAT8(g);
-			SAT8(b);
-			color = (color & 0xFF000000) | (r<<16)|(g<<8)|b;
-#		endif
-		}
-		// Blend
-		unsigned blend = ctx.rendering.mode.named.blend_coef;
-		if (ctx.rendering.mode.named.use_txt_blend) {	// color holds blend coef in bits 3,4,5 of unused byte
-			blend = (color >> (
-#			ifdef GP2X
-				16
-#			else
-				24
-#			endif
-				+ 3)) & 0x3;
-		}
-		if (blend) {
-			uint32_t p = *w_;
-			uint64_t p_alpha = p & 0xFCFCFCFFU;
-			p_alpha = ((uint64_t)p_alpha * blend) >> 2;
-			uint64_t c_alpha = color & 0xFCFCFCFFU;
-			c_alpha = ((uint64_t)c_alpha * (4-blend)) >> 2;
-			color = (uint32_t)p_alpha + (uint32_t)c_alpha;	// actually we need 32bits + carry
-		}
-		// Poke
-		if (ctx.rendering.mode.named.write_out) {
-			*w_ = color;
-		}
-		if (ctx.rendering.mode.named.write_z) {
-			*(w_ + ctx.code.out2zb) = param[0];
+			raster_pixel(w, param, mode);
 		}
 		// Next pixel
-next_pixel:
 		for (unsigned i=sizeof_array(param); i--; ) {
 			param[i] += ctx.line.dparam[i];
 		}
-		if (ctx.rendering.mode.named.perspective) {
-			w += ctx.line.dw;
+		if (mode.named.perspective) {
+			w += ctx.line.dw << out_log;
 			decliv += ctx.poly.decliveness;
 		} else {
-			w ++;
+			w += 1 << out_log;
+		}
+	} while (--count >= 0);
+}
+
+// Lines are drawn with a DDA : w moves one pixel along the major axis for each pixel, and one more
+// along the minor axis each time the 16.16 error term (decliv) overflows. draw_line() already clipped
+// the line to the scissor rectangle.
+void raster_line(void)
+{
+	uint8_t *restrict w = ctx.line.w;
+	unsigned const out_log = ctx.location.pix_log[gpuOutBuffer];
+	gpuMode const mode = ctx.rendering.mode;
+	int32_t const dw = ctx.line.dw * (1<<out_log);	// steps may be negative
+	int32_t const dw_minor = ctx.line.dw_minor * (1<<out_log);
+	int32_t const slope = ctx.poly.decliveness;
+	int32_t err = ctx.line.decliv;
+	int32_t param[GPU_NB_PARAMS];
+	for (unsigned i=sizeof_array(param); i--; ) {
+		param[i] = ctx.line.param[i];
+	}
+	int count = ctx.line.count;
+	do {
+		raster_pixel(w, param, mode);
+		for (unsigned i=sizeof_array(param); i--; ) {
+			param[i] += ctx.line.dparam[i];
+		}
+		w += dw;
+		err += slope;
+		if (err >= 1<<16) {
+			err -= 1<<16;
+			w += dw_minor;
 		}
 	} while (--count >= 0);
 }
 
+// Points have no params but their depth : they are drawn with the current mode, but in flat color.
+// The square (stop excluded) must lie within the scissor rectangle.
+void raster_square(int32_t x_start, int32_t y_start, int32_t x_stop, int32_t y_stop, int32_t z, uint32_t color)
+{
+	gpuMode mode = ctx.rendering.mode;
+	mode.named.rendering_type = rendering_flat;
+	int32_t const param[GPU_NB_PARAMS] = { z, 0, 0, 0 };
+	ctx.code.color = color;
+	unsigned const width_log = ctx.location.buffer_loc[gpuOutBuffer].width_log;
+	unsigned const out_log = ctx.location.pix_log[gpuOutBuffer];
+	for (int32_t y = y_start; y < y_stop; y++) {
+		uint8_t *w = ctx.location.out_start + ((x_start + (y << width_log)) << out_log);
+		for (int32_t x = x_start; x < x_stop; x++) {
+			raster_pixel(w, param, mode);
+			w += 1 << out_log;
+		}
+	}
+}
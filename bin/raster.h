@@ -19,5 +19,7 @@
 #define RASTER_H_060928
 
 void raster_gen(void);
+void raster_line(void);
+void raster_square(int32_t x_start, int32_t y_start, int32_t x_stop, int32_t y_stop, int32_t z, uint32_t color);
 
 #endif
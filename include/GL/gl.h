@@ -41,10 +41,19 @@ typedef unsigned GLbitfield;
 typedef unsigned GLuint;
 
 // Replaces GLX, EGL, ...
-enum glOpen_attribs { DEPTH_BUFFER = 1 };
+enum glOpen_attribs { DEPTH_BUFFER = 1, PACKED_COLOR_BUFFER = 2, PACKED_DEPTH_BUFFER = 4 };	// packed buffers use 16 bits pixels
 GLboolean glOpen(unsigned mask);
 void glClose(void);
 GLboolean glSwapBuffers(void);
+// Textures are uploaded to the GPU when first drawn, and the least recently used are copied back when GPU memory is lacking.
+struct glTextureStats {
+	unsigned resident_words;	// textures now in GPU memory
+	unsigned uploads, upload_words;	// during the last frame
+	unsigned evictions, evicted_words;	// during the last frame
+	unsigned fallbacks;	// number of times another mipmap level was drawn during the last frame, because of the upload budget
+};
+void glTextureBudget(unsigned max_words);	// textures uploaded per frame, beyond which another level is drawn if one is resident. 0 for no limit (default).
+void glGetTextureStats(struct glTextureStats *stats);
 
 // Primitives
 
@@ -38,6 +38,8 @@ extern "C" {
 #define SCREEN_HEIGHT 240
 #define MAX_FACET_SIZE 16
 #define GPU_DEFAULT_DPROJ 8
+#define GPU_DEFAULT_ZSHIFT 8
+#define GPU_DEFAULT_VCACHE_LOG 7
 #define GPU_DEFAULT_CLIPMIN0 ((-SCREEN_WIDTH>>1)-1)
 #define GPU_DEFAULT_CLIPMIN1 ((-SCREEN_HEIGHT>>1)-1)
 #define GPU_DEFAULT_CLIPMAX0 ((SCREEN_WIDTH>>1)+1)
@@ -47,6 +49,12 @@ extern "C" {
 #define GPU_NB_PARAMS 4
 #define GPU_NB_USER_CLIPPLANES 5
 #define GPU_DISPLIST_SIZE 64
+#define GPU_NB_QUERIES 32
+#define GPU_QUERY_PENDING 0xffffffffU	// value of a query slot until the query ends
+#define GPU_NB_JIT_KEYS 16
+#define GPU_NB_PIPELINES 16
+#define GPU_NB_FENCES 16
+#define GPU_DEFRAG_FENCE (GPU_NB_FENCES-1)	// fence slot used by gpuDefrag()
 #define SHARED_PHYSICAL_ADDR 0x2100000	// this is from 920T or for the video controler.
 
 #ifndef sizeof_array
@@ -73,7 +81,7 @@ typedef struct {
 // Commands
 
 extern struct gpuShared {
-	uint32_t cmds[0x40000-5];	// 1Mbytes for commands and following volatiles.
+	uint32_t cmds[0x40000-6-GPU_NB_QUERIES-2*GPU_NB_JIT_KEYS-GPU_NB_FENCES];	// 1Mbytes for commands and following volatiles.
 	// All integer members are supposed to have the same property as sig_atomic_t.
 	volatile uint32_t cmds_begin;	// first word beeing actually used by the gpu. let libgpu read in there.
 	volatile uint32_t cmds_end;	// last word + 1 beeing actually used by the gpu. let libgpu write in there.
@@ -81,6 +89,10 @@ extern struct gpuShared {
 	volatile uint32_t error_flags;	// use a special swap instruction to read&reset it, as a whole or bit by bit depending of available hardware !
 	volatile uint32_t frame_count;
 	volatile uint32_t frame_miss;
+	volatile uint32_t queries[GPU_NB_QUERIES];	// number of pixels that passed the z test during the last query on this slot
+	volatile uint32_t jit_version;	// version of the code generator, to give to gpuPRECOMPILE
+	volatile uint32_t jit_keys[2*GPU_NB_JIT_KEYS];	// keys (low word first) of the codes generated since the GPU started, 0 terminated
+	volatile uint32_t fences[GPU_NB_FENCES];	// value of the last gpuFENCE command on this slot
 	uint32_t buffers[0x740000];	// 29Mbytes for buffers
 #ifdef GP2X
 	uint32_t osd_head[3];
@@ -101,13 +113,34 @@ typedef enum {
 	gpuFACET,
 	gpuRECT,
 	gpuMODE,
+	gpuVCACHE,
+	gpuCULL_SPHERE,
+	gpuCULL_BOX,
+	gpuBEGIN_QUERY,
+	gpuEND_QUERY,
+	gpuIF_VISIBLE,
+	gpuSCISSOR,
+	gpuPRECOMPILE,
+	gpuSETPIPELINE,
+	gpuBIND_PIPELINE,
+	gpuMOVEBUF,
+	gpuUPLOAD,
+	gpuFENCE,
+	gpuLINES,
+	gpuPOINTS,
 	gpuDBG,
 } gpuOpcode;
 
+typedef enum {
+	gpuFmt32,	// one pixel per word (V0UY on GP2X, 0RGB on PC)
+	gpuFmt16,	// packed 16 bits pixels (YUYV on GP2X : even pixels hold U, odd ones V ; RGB565 on PC, depth for z buffers)
+} gpuBufferFormat;
+
 struct buffer_loc {
 	uint32_t address;	// in words, from shared->buffers
 	uint32_t width_log;	// width in pixels ; must be <= 18
 	uint32_t height;
+	uint32_t format;	// a gpuBufferFormat. Texture buffers must be gpuFmt32.
 };
 
 typedef struct {
@@ -142,6 +175,7 @@ typedef struct {
 	gpuOpcode opcode;
 	gpuBufferType type;
 	struct buffer_loc loc;
+	uint32_t z_shift;	// depth mapping of 16 bits z buffers : z is stored as min(z>>z_shift, 0xffff). Must be <= 16.
 } gpuCmdSetBuf;
 
 typedef struct {
@@ -149,6 +183,24 @@ typedef struct {
 	struct buffer_loc loc;
 } gpuCmdShowBuf;
 
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t src, dst;	// addresses in words, from shared->buffers
+	uint32_t size;	// in words. Source and destination must not overlap.
+} gpuCmdMoveBuf;	// copies a buffer, then uses dst wherever it used src (bound buffers, pipelines, frames to display)
+
+typedef struct {
+	gpuOpcode opcode;
+	struct buffer_loc src;	// same size as dst. gpuFmt32 pixels are 0xAARRGGBB words, gpuFmt16 ones are RGB565.
+	struct buffer_loc dst;	// must be gpuFmt32. It can be src itself, otherwise it must not overlap it.
+} gpuCmdUpload;	// converts src pixels to gpuColors into dst
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t slot;	// < GPU_NB_FENCES, GPU_DEFRAG_FENCE being reserved for gpuDefrag()
+	uint32_t value;
+} gpuCmdFence;	// writes value in the slot once all previous commands are done
+
 typedef struct {
 	gpuOpcode opcode;
 	uint32_t size;	// >=3
@@ -163,14 +215,33 @@ typedef struct {
 	uint32_t color;
 } gpuCmdPoint;	// must be followed by 1 gpuCmdVector value
 
+typedef struct {
+	int32_t c3d[3];	// 16.16
+	uint32_t color;
+} gpuCmdPointVec;	// compact vector for gpuPOINTS
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t size;	// number of points
+	uint32_t point_size;	// in pixels, >=1 : points are drawn as squares of this side
+} gpuCmdPoints;	// must be followed by size gpuCmdPointVec values. Drawn with the current mode, in flat color at depth c3d[2]
+
 typedef struct {
 	gpuOpcode opcode;
 	uint32_t color;
 } gpuCmdLine;	// must be followed by 2 gpuCmdVector values
 
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t size;	// number of vectors, >=2
+	uint32_t color;
+	uint32_t strip:1;	// if set, vectors form a line strip (size-1 lines), otherwise a line list (size/2 lines)
+} gpuCmdLines;	// must be followed by size gpuCmdVector values
+
 typedef struct {
 	// no need for opcode because this cmd always follow facet, point and line.
 	uint32_t same_as;	// x,y and z are the same that this last vector. 0 means this same as this one, which of course allways stands true.
+#	define GPU_SAME_AS_ID 0x80000000U	// if set in same_as, the other bits are an identifier of the vector (see gpuCmdVCache)
 	// Params are : x,y,z,  r,g,b|u,v,i
 	union {
 		int32_t all_params[2+GPU_NB_PARAMS];
@@ -220,6 +291,69 @@ typedef struct {
 	gpuMode mode;
 } gpuCmdMode;
 
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t size_log;	// the cache holds 1<<size_log vectors, 2 <= size_log <= 8
+	uint32_t lru:1;	// replace the least recently used vector of a set, or else the oldest one
+} gpuCmdVCache;	// also forgets all cached vectors, so that identifiers can be reused
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t skip;	// number of words following this command that are skipped if the volume is out of the view
+	int32_t center[3];	// 16.16
+	int32_t radius;	// 16.16
+} gpuCmdCullSphere;	// the skipped words must be written with this command (same gpuWritev)
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t skip;	// number of words following this command that are skipped if the volume is out of the view
+	int32_t min[3], max[3];	// 16.16, box aligned with the axis
+} gpuCmdCullBox;	// the skipped words must be written with this command (same gpuWritev)
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t slot;	// < GPU_NB_QUERIES
+} gpuCmdBeginQuery;	// sets the slot to GPU_QUERY_PENDING and starts counting the pixels that pass the z test
+
+typedef struct {
+	gpuOpcode opcode;
+} gpuCmdEndQuery;	// writes the count in the slot
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t slot;	// < GPU_NB_QUERIES
+	uint32_t skip;	// number of words following this command that are skipped if the query counted no pixel
+} gpuCmdIfVisible;	// the skipped words must be written with this command (same gpuWritev)
+
+typedef struct {
+	gpuOpcode opcode;
+	int32_t pos[2];	// lower left corner, in pixels relative to the window
+	uint32_t width, height;	// in pixels
+	uint32_t enable:1;	// if not set, the whole window can be drawn again
+} gpuCmdScissor;	// reset by gpuSETVIEW
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t version;	// the jit_version the keys were read with ; keys are ignored if it changed since
+	uint32_t nb_keys;	// <= GPU_NB_JIT_KEYS
+} gpuCmdPrecompile;	// must be followed by nb_keys keys, as found in jit_keys. Also done on gpuRESET for jit_keys.
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t pipeline;	// < GPU_NB_PIPELINES
+	gpuMode mode;
+	struct buffer_loc loc[GPU_NB_BUFFER_TYPES];
+	uint32_t z_shift;	// as in gpuCmdSetBuf
+	uint32_t use_buf:GPU_NB_BUFFER_TYPES;	// bit N set if loc[N] is part of the pipeline, otherwise the bound buffer is kept
+	uint32_t use_view:1;	// if set, view is part of the pipeline, otherwise the view is kept
+	gpuCmdSetView view;	// opcode is not used
+} gpuCmdSetPipeline;	// defines what gpuBIND_PIPELINE sets, and prepares the rasterizer for it
+
+typedef struct {
+	gpuOpcode opcode;
+	uint32_t pipeline;	// < GPU_NB_PIPELINES, set by gpuSETPIPELINE since the last gpuRESET
+} gpuCmdBindPipeline;	// same as the gpuSETVIEW, gpuSETBUF and gpuMODE commands it replaces
+
 typedef struct {
 	gpuOpcode opcode;
 	int32_t console_enable:1;
@@ -235,6 +369,11 @@ gpuErr gpuWritev(struct iovec const *cmdvec, size_t count, bool can_wait);
 
 uint32_t gpuReadErr(void);
 gpuErr gpuLoadImg(struct buffer_loc const *loc, uint32_t *rgb);
+// Have the GPU convert src into dst (see gpuCmdUpload), then write value in shared->fences[fence]
+gpuErr gpuUploadImg(struct buffer_loc const *dst, struct buffer_loc const *src, unsigned fence, uint32_t value, bool can_wait);
+// Save the keys of the generated codes in a file, and ask for them to be generated again
+gpuErr gpuSaveJitKeys(char const *fname);
+gpuErr gpuLoadJitKeys(char const *fname, bool can_wait);
 // r, g, b are 16.16 ranging from 0 to 1
 // gp2x uses YUV instead of RGB, stored in 32bits words (VYUY, or V0UY)
 static inline int32_t Fix_gpuColor1(int32_t r, int32_t g, int32_t b) {
@@ -312,12 +451,15 @@ static inline uint32_t gpuColor_comp2uint(int32_t c[3]) {
 }
 
 struct gpuBuf *gpuAlloc(unsigned width_log, unsigned height, bool can_wait);	// width is in pixels
+struct gpuBuf *gpuAllocFmt(gpuBufferFormat format, unsigned width_log, unsigned height, bool can_wait);
 void gpuFree(struct gpuBuf *buf);
 void gpuFreeFC(struct gpuBuf *buf, unsigned fc);
 gpuErr gpuSetBuf(gpuBufferType type, struct gpuBuf *buf, bool can_wait);
+gpuErr gpuSetZBuf(struct gpuBuf *buf, uint32_t z_shift, bool can_wait);	// z_shift as in gpuCmdSetBuf
 gpuErr gpuShowBuf(struct gpuBuf *buf, bool can_wait);
-struct buffer_loc const *gpuBuf_get_loc(struct gpuBuf const *buf);
+struct buffer_loc const *gpuBuf_get_loc(struct gpuBuf const *buf);	// waits until the buffer is not being moved
 void gpuWaitDisplay(void);
+unsigned gpuDefrag(unsigned max_words, bool can_wait);	// returns the number of words moved
 
 enum gpuInput {
 	GPU_INPUT_NONE,
@@ -162,3 +162,41 @@ uint32_t gpuReadErr(void)
 	shared->error_flags = 0;
 	return err;
 }
+
+gpuErr gpuSaveJitKeys(char const *fname)
+{
+	uint32_t keys[2+2*GPU_NB_JIT_KEYS];	// as gpuCmdPrecompile wants them, after the opcode
+	unsigned nb_keys = 0;
+	while (nb_keys < GPU_NB_JIT_KEYS && (shared->jit_keys[2*nb_keys] || shared->jit_keys[2*nb_keys+1])) {
+		keys[2+2*nb_keys] = shared->jit_keys[2*nb_keys];
+		keys[2+2*nb_keys+1] = shared->jit_keys[2*nb_keys+1];
+		nb_keys ++;
+	}
+	keys[0] = shared->jit_version;
+	keys[1] = nb_keys;
+	FILE *file = fopen(fname, "wb");
+	if (! file) return gpuESYS;
+	size_t const nb_words = 2+2*nb_keys;
+	bool const ok = fwrite(keys, sizeof(*keys), nb_words, file) == nb_words;
+	if (0 != fclose(file) || ! ok) return gpuESYS;
+	return gpuOK;
+}
+
+gpuErr gpuLoadJitKeys(char const *fname, bool can_wait)
+{
+	struct {
+		gpuCmdPrecompile cmd;
+		uint32_t keys[2*GPU_NB_JIT_KEYS];
+	} precompile = { .cmd = { .opcode = gpuPRECOMPILE } };
+	FILE *file = fopen(fname, "rb");
+	if (! file) return gpuESYS;
+	bool const ok =
+		1 == fread(&precompile.cmd.version, sizeof(uint32_t), 1, file) &&
+		1 == fread(&precompile.cmd.nb_keys, sizeof(uint32_t), 1, file) &&
+		precompile.cmd.nb_keys <= GPU_NB_JIT_KEYS &&
+		2*precompile.cmd.nb_keys == fread(precompile.keys, sizeof(uint32_t), 2*precompile.cmd.nb_keys, file);
+	(void)fclose(file);
+	if (! ok) return gpuEPARAM;
+	if (precompile.cmd.version != shared->jit_version) return gpuOK;	// codes changed since : these keys are useless
+	return gpuWrite(&precompile, sizeof(precompile.cmd) + 2*precompile.cmd.nb_keys*sizeof(uint32_t), can_wait);
+}
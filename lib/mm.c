@@ -16,6 +16,10 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 /* This handle memory (de)allocation of shared->buffers memory region.
+ * It's a buddy allocator : buffers are given blocks of a power of 2 words, aligned on their size,
+ * so that a block and its buddy can be merged again when both are free. The state of the blocks is
+ * kept in a binary tree where each node tells the largest free block below it, so that both
+ * allocation and free are done in a walk from the root to a leaf.
  */
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,35 +35,61 @@
  */
 
 #ifndef NDEBUG
-#	define MEM_DEBUG(txt, buf) do { printf("gpumm: "txt" @%u [%u]\n", (buf)->loc.address, ((buf)->loc.height << (buf)->loc.width_log)); } while (0)
+#	define MEM_DEBUG(txt, buf) do { printf("gpumm: "txt" @%u [%u]\n", (buf)->loc.address, loc_size(&(buf)->loc)); } while (0)
 #else
 #	define MEM_DEBUG(txt, buf) do { (void)(txt); (void)(buf); } while (0)
 #endif
 #define ADDRESS_MAX sizeof_array(shared->buffers)
+#define MIN_ORDER 6	// smallest block is 64 words
+#define TOP_ORDER 23	// biggest block, that covers all shared->buffers (the tail is never free)
+#define NB_BUF_CACHE_CHUNK 256	// descriptors are allocated that many at a time
 
 struct gpuBuf {
 	struct list_head list;
 	struct list_head fc_list;
 	unsigned free_after_fc;	// when framecount > this, the buffer can be freed. yes, we suppose fc never loops.
+	unsigned order;	// log2 of the block size, in words
+	uint32_t moved;	// the GPU_DEFRAG_FENCE value once the last move of this buffer is done
 	struct buffer_loc loc;
 };
-static LIST_HEAD(list);
+static LIST_HEAD(list);	// all allocated buffers
 static LIST_HEAD(fc_list);
 
-static struct buf_cache {
+struct buf_cache {
 	struct list_head cache_list;
 	struct gpuBuf buf;
-} buf_cache[4096];
+};
 static LIST_HEAD(cache_list);
 
+// Node n has children 2n and 2n+1, and the root is 1. Each node holds 1 + the order of the largest
+// free block below it, or 0 if there is none.
+static uint8_t largest[1U << (TOP_ORDER-MIN_ORDER+1)];
+
 static unsigned my_frame_count = 0;
 
+static struct gpuBuf **movables;	// buffers gpuDefrag() may move, highest addresses first
+static unsigned nb_movables_max;
+static uint32_t last_move;	// value of the GPU_DEFRAG_FENCE fence sent after the last move
+
 /*
  * Private Functions
  */
 
+static unsigned loc_size(struct buffer_loc const *loc) {
+	// in words
+	unsigned size = loc->height << loc->width_log;
+	if (loc->format == gpuFmt16) size = (size+1)>>1;
+	return size;
+}
+
 static struct gpuBuf *buf_new(void) {
-	if (list_empty(&cache_list)) return NULL;
+	if (list_empty(&cache_list)) {	// grow the pool
+		struct buf_cache *const chunk = malloc(NB_BUF_CACHE_CHUNK * sizeof(*chunk));
+		if (! chunk) return NULL;
+		for (unsigned i=0; i<NB_BUF_CACHE_CHUNK; i++) {
+			list_add_tail(&chunk[i].cache_list, &cache_list);
+		}
+	}
 	struct buf_cache *bc = list_entry(cache_list.next, struct buf_cache, cache_list);
 	list_del(&bc->cache_list);
 	return &bc->buf;
@@ -72,12 +102,60 @@ static void buf_del(struct gpuBuf *buf) {
 	list_add_tail(&bc->cache_list, &cache_list);
 }
 
+// Recomputes node from its children, which orders are order-1.
+static void update_node(unsigned node, unsigned order) {
+	uint8_t const left = largest[2*node], right = largest[2*node+1];
+	if (left == order && right == order) {	// both are free : merge them
+		largest[node] = order+1;
+	} else {
+		largest[node] = left > right ? left:right;
+	}
+}
+
+static void update_parents(unsigned node, unsigned order) {
+	for ( ; node > 1; node >>= 1) {
+		order ++;
+		update_node(node>>1, order);
+	}
+}
+
+static unsigned size_order(unsigned size) {
+	if (size <= 1U<<MIN_ORDER) return MIN_ORDER;
+	return Fix_log2(size-1)+1;
+}
+
+// Returns the address of a free block of this order, now used, or ADDRESS_MAX if there is none.
+static unsigned block_alloc(unsigned order) {
+	if (order > TOP_ORDER || largest[1] < order+1) return ADDRESS_MAX;
+	unsigned node = 1, node_order = TOP_ORDER;
+	while (node_order > order) {
+		node = 2*node + (largest[2*node] < order+1);	// left if it's large enough
+		node_order --;
+	}
+	largest[node] = 0;
+	update_parents(node, order);
+	return (node - (1U << (TOP_ORDER-order))) << order;
+}
+
+static void block_free(unsigned address, unsigned order) {
+	unsigned const node = (1U << (TOP_ORDER-order)) + (address >> order);
+	assert(largest[node] == 0);
+	largest[node] = order+1;
+	update_parents(node, order);
+}
+
 static void free_buf(struct gpuBuf *buf) {
 	assert(buf);
 	list_del(&buf->list);
+	block_free(buf->loc.address, buf->order);
 	buf_del(buf);
 }
 
+// Tells whether the GPU is done with the last move of buf, after which the CPU may access it again
+static bool move_done(struct gpuBuf const *buf) {
+	return (int32_t)(shared->fences[GPU_DEFRAG_FENCE] - buf->moved) >= 0;
+}
+
 static void free_fc(void) {
 	// free all possible buffers based on frame count
 	struct gpuBuf *buf, *next;
@@ -92,44 +170,115 @@ static void free_fc(void) {
 	}
 }
 
-struct gpuBuf *gpuAlloc_(unsigned width_log, unsigned height) {
-	struct gpuBuf *buf = NULL;
-	unsigned size = height << width_log;
-	unsigned next_free = 0;
+struct gpuBuf *gpuAlloc_(gpuBufferFormat format, unsigned width_log, unsigned height) {
+	unsigned size = loc_size(&(struct buffer_loc){ .width_log = width_log, .height = height, .format = format });
 	free_fc();
-	list_for_each_entry(buf, &list, list) {
-		assert(buf->loc.address >= next_free);	// supposed to be sorted in ascending order
-		if (buf->loc.address - next_free >= size) {
-			break;
-		}
-		next_free = buf->loc.address + (buf->loc.height<<buf->loc.width_log);
-	}
-	if (next_free + size > ADDRESS_MAX) return NULL;
 	struct gpuBuf *new = buf_new();
 	if (! new) return NULL;
-	new->loc.address = next_free;
+	new->order = size_order(size);
+	new->moved = last_move;
+	new->loc.address = block_alloc(new->order);
+	if (new->loc.address == ADDRESS_MAX) {
+		buf_del(new);
+		return NULL;
+	}
 	new->loc.width_log = width_log;
 	new->loc.height = height;
+	new->loc.format = format;
 	new->free_after_fc = ~0;	// if FC never loops, we will never free this one (until requested bu Free()/FreeFC()
-	list_add_tail(&new->list, &buf->list);	// add before buf
+	list_add_tail(&new->list, &list);
 	MEM_DEBUG("new", new);
 	return new;
 }
 
+static int cmp_address_desc(void const *a_, void const *b_) {
+	struct gpuBuf const *const *a = a_, *const *b = b_;
+	return (*a)->loc.address < (*b)->loc.address ? 1 : (*a)->loc.address > (*b)->loc.address ? -1 : 0;
+}
+
+// Returns the number of buffers gpuDefrag() may move, in movables.
+static unsigned list_movables(void) {
+	unsigned nb = 0;
+	struct gpuBuf *buf;
+	list_for_each_entry(buf, &list, list) {
+		if (buf->free_after_fc != ~0U) continue;	// will be freed soon
+		if (nb >= nb_movables_max) {
+			unsigned const new_max = nb_movables_max ? 2*nb_movables_max : NB_BUF_CACHE_CHUNK;
+			struct gpuBuf **const new = realloc(movables, new_max * sizeof(*movables));
+			if (! new) break;
+			movables = new;
+			nb_movables_max = new_max;
+		}
+		movables[nb++] = buf;
+	}
+	qsort(movables, nb, sizeof(*movables), cmp_address_desc);
+	return nb;
+}
+
+// Moves buf to a lower block if there is one.
+static bool move_buf(struct gpuBuf *buf, bool can_wait) {
+	unsigned const address = block_alloc(buf->order);
+	if (address == ADDRESS_MAX) return false;
+	if (address > buf->loc.address) goto mb_err0;
+	// the old block is still used by the commands sent before, so it's freed once they are done
+	struct gpuBuf *const old = buf_new();
+	if (! old) goto mb_err0;
+	old->order = buf->order;
+	old->loc = buf->loc;
+	gpuCmdMoveBuf const move = {
+		.opcode = gpuMOVEBUF,
+		.src = buf->loc.address,
+		.dst = address,
+		.size = loc_size(&buf->loc),
+	};
+	// the copy is done later : the fence tells the CPU when it may write into the buffer again
+	gpuCmdFence const fence = {
+		.opcode = gpuFENCE,
+		.slot = GPU_DEFRAG_FENCE,
+		.value = last_move + 1,
+	};
+	struct iovec const cmdvec[] = {
+		{ .iov_base = (void *)&move, .iov_len = sizeof(move) },
+		{ .iov_base = (void *)&fence, .iov_len = sizeof(fence) },
+	};
+	if (gpuOK != gpuWritev(cmdvec, sizeof_array(cmdvec), can_wait)) goto mb_err1;
+	last_move ++;
+	list_add_tail(&old->list, &list);
+	gpuFreeFC(old, 0);
+	buf->loc.address = address;
+	buf->moved = last_move;
+	MEM_DEBUG("move", buf);
+	return true;
+mb_err1:
+	buf_del(old);
+mb_err0:
+	block_free(address, buf->order);
+	return false;
+}
+
 /*
  * Public Functions
  */
 
 void gpuMMInit(void) {
-	for (unsigned i=0; i<sizeof_array(buf_cache); i++) {
-		list_add_tail(&buf_cache[i].cache_list, &cache_list);
+	// leaves are free if they are entirely within shared->buffers
+	unsigned const nb_leaves = 1U << (TOP_ORDER-MIN_ORDER);
+	for (unsigned l=0; l<nb_leaves; l++) {
+		largest[nb_leaves + l] = (l+1) << MIN_ORDER <= ADDRESS_MAX ? MIN_ORDER+1 : 0;
 	}
+	for (unsigned order=MIN_ORDER+1; order<=TOP_ORDER; order++) {
+		unsigned const first = 1U << (TOP_ORDER-order);
+		for (unsigned node=first; node<2*first; node++) {
+			update_node(node, order);
+		}
+	}
+	last_move = shared->fences[GPU_DEFRAG_FENCE];	// as left by a previous client
 }
 
-struct gpuBuf *gpuAlloc(unsigned width_log, unsigned height, bool can_wait) {
+struct gpuBuf *gpuAllocFmt(gpuBufferFormat format, unsigned width_log, unsigned height, bool can_wait) {
 	struct gpuBuf *buf;
 	do {
-		buf = gpuAlloc_(width_log, height);
+		buf = gpuAlloc_(format, width_log, height);
 		if (buf || !can_wait) return buf;
 		unsigned fc = shared->frame_count;
 		do {
@@ -137,9 +286,17 @@ struct gpuBuf *gpuAlloc(unsigned width_log, unsigned height, bool can_wait) {
 		} while (shared->frame_count == fc);
 	} while (1);
 }
+
+struct gpuBuf *gpuAlloc(unsigned width_log, unsigned height, bool can_wait) {
+	return gpuAllocFmt(gpuFmt32, width_log, height, can_wait);
+}
 		
 void gpuFree(struct gpuBuf *buf) {
 	assert(buf);
+	if (! move_done(buf)) {	// the GPU is still to copy into it
+		gpuFreeFC(buf, 0);
+		return;
+	}
 	free_buf(buf);
 }
 
@@ -149,16 +306,24 @@ void gpuFreeFC(struct gpuBuf *buf, unsigned fc) {
 	list_add_tail(&buf->fc_list, &fc_list);
 }
 
-gpuErr gpuSetBuf(gpuBufferType type, struct gpuBuf *buf, bool can_wait) {
+static gpuErr set_buf(gpuBufferType type, struct gpuBuf *buf, uint32_t z_shift, bool can_wait) {
 	gpuCmdSetBuf setBuf = {
 		.opcode = gpuSETBUF,
 		.type = type,
+		.z_shift = z_shift,
 	};
 	assert(buf);
-	if (type == gpuTxtBuffer && !is_power_of_2(buf->loc.height)) return gpuEPARAM;
+	if (type == gpuTxtBuffer && (!is_power_of_2(buf->loc.height) || buf->loc.format != gpuFmt32)) return gpuEPARAM;
 	setBuf.loc = buf->loc;
 	return gpuWrite(&setBuf, sizeof(setBuf), can_wait);
 }
+gpuErr gpuSetBuf(gpuBufferType type, struct gpuBuf *buf, bool can_wait) {
+	return set_buf(type, buf, GPU_DEFAULT_ZSHIFT, can_wait);
+}
+gpuErr gpuSetZBuf(struct gpuBuf *buf, uint32_t z_shift, bool can_wait) {
+	if (z_shift > 16) return gpuEPARAM;
+	return set_buf(gpuZBuffer, buf, z_shift, can_wait);
+}
 gpuErr gpuShowBuf(struct gpuBuf *buf, bool can_wait) {
 	static gpuCmdShowBuf show = {
 		.opcode = gpuSHOWBUF,
@@ -174,9 +339,25 @@ sb_quit:
 }
 
 struct buffer_loc const *gpuBuf_get_loc(struct gpuBuf const *buf) {
+	// the caller may write into the buffer : wait until gpuDefrag() moves are done
+	while (! move_done(buf)) {
+		(void)sched_yield();
+	}
 	return &buf->loc;
 }
 
+unsigned gpuDefrag(unsigned max_words, bool can_wait) {
+	free_fc();
+	unsigned const nb = list_movables();
+	unsigned moved = 0;
+	for (unsigned m=0; m<nb && moved < max_words; m++) {
+		unsigned const size = loc_size(&movables[m]->loc);
+		if (moved + size > max_words) continue;
+		if (move_buf(movables[m], can_wait)) moved += size;
+	}
+	return moved;
+}
+
 void gpuWaitDisplay(void) {
 	while (shared->frame_count < my_frame_count-1) {
 		(void)sched_yield();
@@ -35,3 +35,26 @@ gpuErr gpuLoadImg(struct buffer_loc const *loc, uint32_t *rgb) {
 	return gpuOK;
 }
 
+gpuErr gpuUploadImg(struct buffer_loc const *dst, struct buffer_loc const *src, unsigned fence, uint32_t value, bool can_wait) {
+	if (
+		fence >= GPU_NB_FENCES ||
+		dst->format != gpuFmt32 ||
+		src->width_log != dst->width_log || src->height != dst->height
+	) return gpuEPARAM;
+	gpuCmdUpload upload = {
+		.opcode = gpuUPLOAD,
+		.src = *src,
+		.dst = *dst,
+	};
+	gpuCmdFence fence_cmd = {
+		.opcode = gpuFENCE,
+		.slot = fence,
+		.value = value,
+	};
+	struct iovec const cmdvec[] = {
+		{ .iov_base = &upload, .iov_len = sizeof(upload) },
+		{ .iov_base = &fence_cmd, .iov_len = sizeof(fence_cmd) },
+	};
+	return gpuWritev(cmdvec, sizeof_array(cmdvec), can_wait);
+}
+
@@ -0,0 +1,117 @@
+/* This file is part of gpu940.
+ *
+ * Copyright (C) 2006 Cedric Cellier.
+ *
+ * Gpu940 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2.
+ *
+ * Gpu940 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gpu940; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Times gpuAlloc()/gpuFree() against the first fit walk of a sorted list that lib/mm.c used
+ * before, on a stream of transient buffers. Does not need the GPU to run. The library must be
+ * built with -DNDEBUG, or its debug messages are timed too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <gpu940.h>
+#include "../lib/kernlist.h"
+#include "../lib/mm.h"
+
+#define NB_LIVE 512	// buffers allocated at any time
+#define NB_OPS 200000
+
+struct ref_buf {
+	struct list_head list;
+	unsigned address, size;
+};
+static LIST_HEAD(ref_list);
+
+static unsigned rnd(void) {
+	static unsigned s = 1;
+	s = s*1103515245U + 12345U;
+	return s >> 8;
+}
+
+// What gpuAlloc_() used to do : walk the buffers sorted by address up to the first large enough gap
+static struct ref_buf *ref_alloc(unsigned size) {
+	struct ref_buf *buf;
+	unsigned next_free = 0;
+	list_for_each_entry(buf, &ref_list, list) {
+		if (buf->address - next_free >= size) break;
+		next_free = buf->address + buf->size;
+	}
+	if (next_free + size > sizeof_array(shared->buffers)) return NULL;
+	struct ref_buf *new = malloc(sizeof(*new));
+	if (! new) return NULL;
+	new->address = next_free;
+	new->size = size;
+	list_add_tail(&new->list, &buf->list);	// add before buf
+	return new;
+}
+
+static void ref_free(struct ref_buf *buf) {
+	list_del(&buf->list);
+	free(buf);
+}
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+// Mostly small textures, some bigger ones
+static void random_size(unsigned *width_log, unsigned *height) {
+	*width_log = 3 + rnd()%6;
+	*height = 1U << (3 + rnd()%6);
+	if (rnd()%64 == 0) {
+		*width_log = 9;
+		*height = 246;
+	}
+}
+
+int main(void) {
+	shared = calloc(1, sizeof(*shared));
+	if (! shared) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	gpuMMInit();
+	static struct gpuBuf *bufs[NB_LIVE];
+	static struct ref_buf *ref_bufs[NB_LIVE];
+	unsigned width_log, height, failures = 0;
+	// gpuAlloc()
+	double start = now();
+	for (unsigned op=0; op<NB_OPS; op++) {
+		unsigned const b = rnd() % NB_LIVE;
+		if (bufs[b]) gpuFree(bufs[b]);
+		random_size(&width_log, &height);
+		bufs[b] = gpuAlloc(width_log, height, false);
+		if (! bufs[b]) failures ++;
+	}
+	double const buddy_time = now() - start;
+	printf("gpuAlloc   : %6.0f ns per alloc+free, %u failures\n", buddy_time*1e9/NB_OPS, failures);
+	// first fit list walk, with the same sizes
+	failures = 0;
+	start = now();
+	for (unsigned op=0; op<NB_OPS; op++) {
+		unsigned const b = rnd() % NB_LIVE;
+		if (ref_bufs[b]) ref_free(ref_bufs[b]);
+		random_size(&width_log, &height);
+		ref_bufs[b] = ref_alloc(height << width_log);
+		if (! ref_bufs[b]) failures ++;
+	}
+	double const ref_time = now() - start;
+	printf("first fit  : %6.0f ns per alloc+free, %u failures\n", ref_time*1e9/NB_OPS, failures);
+	return EXIT_SUCCESS;
+}